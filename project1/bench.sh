@@ -0,0 +1,67 @@
+#!/bin/bash
+# sort generated inputs of every size & distribution with ./run, check each output's order
+# and checksum against its input, and append throughput to a CSV file.
+# usage: ./bench.sh [size ...](default 1G 2G 4G 16G 64G, sizes as ./data_gen takes them)
+# environment:
+#   BENCH_DIST   distributions of ./data_gen -d          (default random)
+#   BENCH_DIR    where inputs, outputs & runs go         (default .)
+#   BENCH_CSV    results, appended                       (default bench.csv)
+#   BENCH_KEEP   keep generated inputs when set
+#   RUN          sort binary & options, e.g. "./run -t 8"(default ./run of this folder)
+set -u -o pipefail
+
+SIZES=${*:-1G 2G 4G 16G 64G}
+DIST=${BENCH_DIST:-random}
+DIR=${BENCH_DIR:-.}
+CSV=${BENCH_CSV:-bench.csv}
+BIN=$(cd "$(dirname "$0")" && pwd)
+RUN=${RUN:-$BIN/run}
+set -- $RUN
+RUN="$(realpath "$1")${2:+ ${*:2}}"  # runs from BENCH_DIR, where its *.tmp files go
+
+make -C "$BIN" run data_gen validate > /dev/null || exit 1
+[ -f "$CSV" ] || echo "date,size,dist,command,seconds,mb_per_s,sorted,checksum,stats" > "$CSV"
+
+status=0
+for dist in $DIST; do
+  for size in $SIZES; do
+    in="$DIR/bench_${size}_$dist.data"
+    out="$DIR/bench_${size}_$dist.test"
+    stats="$DIR/bench_${size}_$dist.json"
+    # input, output & runs of intermediate passes
+    need=$(awk -v s="$size" 'BEGIN { n = s + 0; u = toupper(substr(s, length(s)));
+      n *= (u == "T" ? 1e12 : u == "G" ? 1e9 : u == "M" ? 1e6 : u == "K" ? 1e3 : 100);
+      printf "%.0f", n * 2.1 }')
+    avail=$(df --output=avail -B1 "$DIR" | tail -1)
+    if [ ! -f "$in" ] && [ "$avail" -lt "$need" ]; then
+      echo "skip $size $dist: needs $((need / 1000000000))GB, $((avail / 1000000000))GB free"
+      continue
+    fi
+
+    if [ ! -f "$in" ]; then
+      "$BIN/data_gen" -d "$dist" "$size" "$in" || exit 1
+    fi
+    sync
+    start=$(date +%s%N)
+    (cd "$DIR" && $RUN -s "$(basename "$stats")" "$(basename "$in")" "$(basename "$out")") > /dev/null
+    ret=$?
+    end=$(date +%s%N)
+    ms=$(((end - start) / 1000000))
+
+    check=$("$BIN/validate" "$in" "$out")
+    ok=$?
+    echo "$check"
+    [ $ret -eq 0 ] && [ $ok -eq 0 ] || status=1
+    sorted=$(echo "$check" | grep -q " sorted," && echo yes || echo no)
+    match=$(echo "$check" | grep -q " same tuples" && echo ok || echo mismatch)
+    seconds=$((ms / 1000)).$(printf %03d $((ms % 1000)))
+    bytes=$(stat -c %s "$in")
+    mbps=$((bytes / 1000 / (ms > 0 ? ms : 1)))
+    echo "$size $dist: ${seconds}s, $mbps MB/s"
+    echo "$(date -Iseconds),$size,$dist,$RUN,$seconds,$mbps,$sorted,$match,$stats" >> "$CSV"
+
+    rm -f "$out"
+    [ -n "${BENCH_KEEP:-}" ] || rm -f "$in"
+  done
+done
+exit $status
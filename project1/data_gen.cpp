@@ -0,0 +1,162 @@
+#include "external_sort.h"
+#include <cmath>
+#include <random>
+
+// generate input files of the build's record layout.
+// usage: ./data_gen [-d dist] [-u distinct] [-r seed] [-t threads] size outfile
+// size is tuples, or bytes with a K/M/G/T suffix(1G = 1000000000 bytes).
+// prints the order independent checksum of the file, as ./validate does.
+#define GEN_BLOCK       (65536UL)
+
+enum DIST { RANDOM, ASCII, ZIPF, SORTED, REVERSE, DUPS, RUNS };
+static const char *dist_names[] = {"random", "ascii", "zipf", "sorted", "reverse", "dups", "runs", NULL};
+
+// KEY_SIZE bytes: big endian scaled rank(of distinct ranks) in the first 8, zeros behind.
+// ranks keep their order, and are spread over the whole key space.
+static void rankKey(unsigned char *key, uint64_t rank, uint64_t distinct)
+{
+  const size_t kb = min((size_t)8, KEY_SIZE);
+  uint64_t v = ((unsigned __int128)rank << (8 * kb)) / distinct;
+  memset(key, 0, KEY_SIZE);
+  for (size_t i = 0; i < kb; i++)
+    key[i] = v >> (8 * (kb - 1 - i));
+}
+
+// tuple i of the file. every block of GEN_BLOCK tuples has its own generator, so
+// contents do not depend on thread count.
+static void makeTuple(TUPLETYPE &tuple, DIST dist, uint64_t i, uint64_t count, uint64_t distinct,
+                      mt19937_64 &gen)
+{
+  unsigned char *key = tuple.binary + KEY_OFFSET;
+  if (dist == ASCII) {// gensort -a like: printable key, index & filler letters, "\r\n"
+    char text[TUPLE_SIZE - KEY_SIZE + 32];
+    int n = snprintf(text, sizeof(text), "  %016llX  ", (unsigned long long)i);
+    for (size_t j = n; j < TUPLE_SIZE - KEY_SIZE; j++)
+      text[j] = 'A' + (i + (j - n) / 4) % 26;
+    if (TUPLE_SIZE - KEY_SIZE >= 2)
+      memcpy(text + TUPLE_SIZE - KEY_SIZE - 2, "\r\n", 2);
+    memcpy(tuple.binary, text, KEY_OFFSET);
+    memcpy(key + KEY_SIZE, text + KEY_OFFSET, TUPLE_SIZE - KEY_OFFSET - KEY_SIZE);
+    for (size_t j = 0; j < KEY_SIZE; j++)
+      key[j] = ' ' + gen() % 95;
+    return;
+  }
+
+  for (size_t j = 0; j < TUPLE_SIZE; j += 8) {
+    uint64_t r = gen();
+    memcpy(tuple.binary + j, &r, min((size_t)8, TUPLE_SIZE - j));
+  }
+  switch (dist) {
+    case ZIPF:// zipf(s = 1) ranks, as floor of log uniform: P(rank < k) = log(k + 1) / log(distinct + 1)
+      rankKey(key, min(distinct - 1, (uint64_t)exp(generate_canonical<double, 53>(gen) * log(distinct + 1.0)) - 1),
+              distinct);
+      break;
+    case SORTED:  rankKey(key, i, count); break;
+    case REVERSE: rankKey(key, count - 1 - i, count); break;
+    case DUPS:    rankKey(key, gen() % distinct, distinct); break;
+    case RUNS: {// increasing runs of `distinct` tuples each, interleaved over the same key range
+      const uint64_t runs = (count + distinct - 1) / distinct;
+      rankKey(key, i % distinct * runs + i / distinct, distinct * runs);
+      break;
+    }
+    default: break;
+  }
+}
+
+static size_t parseCount(const char *str)
+{
+  char *end;
+  double size = strtod(str, &end);
+  switch (toupper(*end)) {
+    case 'T': size *= 1e3;// fall through
+    case 'G': size *= 1e3;// fall through
+    case 'M': size *= 1e3;// fall through
+    case 'K': return size * 1e3 / TUPLE_SIZE;
+  }
+  return size;
+}
+
+static void writeAll(int fd, const void *buf, size_t nbyte, size_t offset)
+{
+  for (size_t done = 0; done < nbyte; ) {
+    ssize_t ret = pwrite(fd, (const char*)buf + done, nbyte - done, offset + done);
+    if (ret <= 0) {
+      printf("error: write output file\n");
+      exit(1);
+    }
+    done += ret;
+  }
+}
+
+static int generate(const char *path, DIST dist, size_t count, uint64_t distinct, uint64_t seed)
+{
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd == -1) {
+    printf("error: open %s file\n", path);
+    return 1;
+  }
+  if (ftruncate(fd, count * TUPLE_SIZE) != 0) {
+    printf("error: size %s file\n", path);
+    return 1;
+  }
+
+  const size_t nblocks = (count + GEN_BLOCK - 1) / GEN_BLOCK;
+  uint64_t sum = 0;
+  #pragma omp parallel num_threads(max_threads) reduction(+:sum)
+  {
+    vector<TUPLETYPE> buf(GEN_BLOCK);
+    #pragma omp for schedule(dynamic)
+    for (size_t b = 0; b < nblocks; b++) {
+      mt19937_64 gen(seed * 0x9E3779B97F4A7C15ULL + b);
+      size_t first = b * GEN_BLOCK, n = min(GEN_BLOCK, count - first);
+      for (size_t i = 0; i < n; i++) {
+        makeTuple(buf[i], dist, first + i, count, distinct, gen);
+        sum += tupleSum(buf[i], 0);
+      }
+      writeAll(fd, buf.data(), n * TUPLE_SIZE, first * TUPLE_SIZE);
+    }
+  }
+  close(fd);
+  printf("%s: %zu tuples %s, checksum %016llx\n", path, count, dist_names[dist], (unsigned long long)sum);
+
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{
+  DIST dist = RANDOM;
+  uint64_t seed = 1, distinct = 0;
+  int opt;
+
+  while (optind <= argc && (opt = getopt(argc, argv, "d:r:t:u:")) != -1) {// unknown option stops it
+    switch (opt) {
+      case 'r': seed = strtoull(optarg, NULL, 10); break;
+      case 't': max_threads = max(1, atoi(optarg)); break;
+      case 'u': distinct = parseCount(optarg); break;
+      case 'd':
+        for (int i = 0; ; i++) {
+          if (dist_names[i] == NULL) {
+            printf("error: unknown distribution %s\n", optarg);
+            return 1;
+          }
+          if (strcmp(optarg, dist_names[i]) == 0) {
+            dist = (DIST)i;
+            break;
+          }
+        }
+        break;
+      default: optind = argc + 1;
+    }
+  }
+  if (optind + 2 != argc) {
+    printf("usage: %s [-d random|ascii|zipf|sorted|reverse|dups|runs] [-u distinct] [-r seed] [-t threads] size outfile\n",
+           argv[0]);
+    return 1;
+  }
+
+  size_t count = parseCount(argv[optind]);
+  if (distinct == 0)// zipf over every rank, dups about 1000 of each key, 4 runs
+    distinct = (dist == DUPS ? max((size_t)1, count / 1000)
+                : dist == RUNS ? max((size_t)1, (count + 3) / 4) : max((size_t)1, count));
+  return generate(argv[optind + 1], dist, count, distinct, seed);
+}
@@ -0,0 +1,157 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "external_sort.h"
+#include "stats.h"
+#include "topology.h"
+#include <map>
+#include <mutex>
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE (23)
+#endif
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB     (0x40000)
+#endif
+// huge page size the arena is rounded to.
+#define HUGE_PAGE       (2097152UL)
+
+// tuple buffers(chunks, survivors, preloaded heads, read & write buffers) are carved from
+// one mapping of the whole budget, reserved on first use. it is backed by explicit huge
+// pages if the pool holds it, transparent huge pages otherwise. pages are faulted in by
+// every thread the first time a buffer reaches them, instead of one thread on first touch.
+// blocks are DIRECT_ALIGN aligned, first fit, and merged with free neighbours when released.
+class ARENA {
+  public:
+    char *base;
+    size_t size;
+    size_t faulted;     // bytes from base that were faulted in
+    bool hugetlb;       // explicit huge pages
+
+    ARENA() : base(NULL), size(0), faulted(0), hugetlb(false) {};
+
+    void reserve(size_t nbyte);
+    void* alloc(size_t nbyte);
+    bool release(void *ptr);
+
+  private:
+    map<size_t, size_t> free_blocks;// offset -> bytes
+    map<size_t, size_t> used_blocks;
+    mutex lock;
+
+    void prefault(size_t end);
+};
+
+ARENA arena;
+
+inline void ARENA::reserve(size_t nbyte)
+{
+  size = (nbyte + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+  // no MAP_NORESERVE: mmap fails up front if the huge page pool is short, instead of a SIGBUS later.
+  void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  hugetlb = (addr != MAP_FAILED);
+  if (!hugetlb) {
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED)// every buffer falls back to posix_memalign
+      return;
+    madvise(addr, size, MADV_HUGEPAGE);
+  }
+  base = (char*)addr;
+  free_blocks[0] = size;
+#ifdef VERBOSE
+  printf("arena: %zu bytes, %s huge pages\n", size, (hugetlb ? "explicit" : "transparent"));
+#endif
+}
+
+inline void* ARENA::alloc(size_t nbyte)
+{
+  lock_guard<mutex> guard(lock);
+  if (base == NULL && size == 0)
+    reserve(max(memory_budget, nbyte));
+  nbyte = (max(nbyte, (size_t)1) + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+  for (auto it = free_blocks.begin(); it != free_blocks.end(); it++) {
+    if (it->second < nbyte)
+      continue;
+    size_t offset = it->first, left = it->second - nbyte;
+    free_blocks.erase(it);
+    if (left)
+      free_blocks[offset + nbyte] = left;
+    used_blocks[offset] = nbyte;
+    prefault(offset + nbyte);
+    return base + offset;
+  }
+  return NULL;
+}
+
+inline bool ARENA::release(void *ptr)
+{
+  if (base == NULL || (char*)ptr < base || (char*)ptr >= base + size)
+    return false;
+  lock_guard<mutex> guard(lock);
+  auto used = used_blocks.find((char*)ptr - base);
+  size_t offset = used->first, nbyte = used->second;
+  used_blocks.erase(used);
+  auto next = free_blocks.lower_bound(offset);
+  if (next != free_blocks.end() && next->first == offset + nbyte) {
+    nbyte += next->second;
+    next = free_blocks.erase(next);
+  }
+  if (next != free_blocks.begin()) {
+    auto prev = std::prev(next);
+    if (prev->first + prev->second == offset) {
+      prev->second += nbyte;
+      return true;
+    }
+  }
+  free_blocks[offset] = nbyte;
+  return true;
+}
+
+// fault [faulted, end) in, a slice per thread(on its node with NUMA). pages stay faulted
+// when blocks are released.
+inline void ARENA::prefault(size_t end)
+{
+  if (end <= faulted)
+    return;
+  const uint64_t start = STATS::now();
+  const size_t page = (hugetlb ? HUGE_PAGE : getpagesize());
+  const size_t from = faulted / page * page, to = min(size, (end + page - 1) / page * page);
+  const int threads = max(1, min(max_threads, (int)((to - from) / HUGE_PAGE)));
+  #pragma omp parallel for num_threads(threads)
+  for (int t = 0; t < threads; t++) {
+    size_t lo = from + (to - from) / page * t / threads * page;
+    size_t hi = (t == threads - 1 ? to : from + (to - from) / page * (t+1) / threads * page);
+    PINNED pin(t, threads);
+    placeSlice(base + lo, hi - lo, t, threads);
+    if (madvise(base + lo, hi - lo, MADV_POPULATE_WRITE) != 0)// before linux 5.14: touch every page
+      for (size_t p = lo; p < hi; p += page)
+        base[p] = 0;
+  }
+  faulted = to;
+  stats.fault_ns += STATS::now() - start;
+#ifdef VERBOSE
+  printf("prefault of %zu bytes took %.1fms\n", to - from, (STATS::now() - start) / 1e6);
+#endif
+}
+
+inline TUPLETYPE* allocTuples(size_t count)
+{
+  // block aligned, so O_DIRECT can read & write tuple buffers in place.
+  // from the arena, unless it is full(or could not be mapped).
+  void *ptr = arena.alloc(count * TUPLE_SIZE);
+  if (ptr != NULL)
+    return (TUPLETYPE*)ptr;
+  if (posix_memalign(&ptr, DIRECT_ALIGN, max(count, (size_t)1) * TUPLE_SIZE) != 0) {
+    printf("error: allocate %zu tuples\n", count);
+    exit(1);
+  }
+  return (TUPLETYPE*)ptr;
+}
+
+inline void freeTuples(TUPLETYPE *tuples)
+{
+  if (!arena.release(tuples))
+    free(tuples);
+}
+
+#endif
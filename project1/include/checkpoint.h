@@ -0,0 +1,203 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "external_sort.h"
+#include "run_codec.h"
+#include <sys/stat.h>
+
+// CHECKPOINT: after a header naming the input, layout & mode, every finished run is appended
+// to MANIFEST_FILE (synced, like the run itself) as
+//   run <name> <plain|packed> <chunk,chunk,..> <tuples> <bytes on disk> <checksum> <first key> <last key>
+// a restarted ./run of the same input loads runs that still check out instead of sorting
+// their chunks again. a run of an intermediate pass replaces the runs it was merged from.
+#define MANIFEST_FILE   "extsort.manifest"
+
+inline string keyHex(const TUPLETYPE &tuple)
+{
+  char hex[2 * KEY_SIZE + 1];
+  for (size_t i = 0; i < KEY_SIZE; i++)
+    sprintf(hex + 2*i, "%02x", keyOf(tuple)[i]);
+  return string(hex);
+}
+
+inline uint64_t runSum(const TUPLETYPE *tuples, size_t count, size_t first)
+{
+  uint64_t sum = 0;
+  #pragma omp parallel for num_threads(max_threads) reduction(+:sum)
+  for (size_t i = 0; i < count; i++)
+    sum += tupleSum(tuples[i], first + i);
+  return sum;
+}
+
+inline void recordRun(const FILEINFO &file)
+{
+  if (manifest == NULL)
+    return;
+  string chunks;
+  for (size_t i = 0; i < file.chunks.size(); i++)
+    chunks += (i ? "," : "") + to_string(file.chunks[i]);
+  fprintf(manifest, "run %s %s %s %zu %zu %016llx %s %s\n", file.file_name.c_str(),
+          (file.blocks.empty() ? "plain" : "packed"), chunks.c_str(),
+          file.tuples(), (file.blocks.empty() ? file.size : file.blocks.back()),
+          (unsigned long long)file.checksum, file.first_key.c_str(), file.last_key.c_str());
+  fflush(manifest);
+  fsync(fileno(manifest));
+}
+
+// output is complete: nothing left to resume.
+inline void closeManifest(int output_fd)
+{
+  if (manifest == NULL)
+    return;
+  fdatasync(output_fd);
+  fclose(manifest);
+  manifest = NULL;
+  unlink(MANIFEST_FILE);
+}
+
+// read the whole run through buf (2 x buf_tuples), checking it against its record.
+// rebuilds the sparse index & block table on the way.
+inline bool loadRun(FILEINFO &file, bool compressed, size_t bytes, TUPLETYPE *buf[2], size_t buf_tuples)
+{
+  struct stat st;
+  if (stat(file.file_name.c_str(), &st) != 0 || (size_t)st.st_size != bytes)
+    return false;
+  int fd = openFile(file.file_name.c_str(), O_RDONLY);
+  if (fd == -1)
+    return false;
+
+  const size_t count = file.tuples(), buf_size = buf_tuples * TUPLE_SIZE;
+  size_t pos = 0, offset = 0;
+  uint64_t sum = 0;
+  bool ok = true;
+  string first, last;
+
+  file.blocks.assign(compressed ? 1 : 0, 0);
+  while (ok && pos < count) {
+    TUPLETYPE *run = buf[0];
+    size_t n = min(buf_tuples, count - pos);
+    if (!compressed) {
+      ok = (readFromFile(fd, run, n * TUPLE_SIZE, pos * TUPLE_SIZE) == n * TUPLE_SIZE);
+    } else {// whole blocks that fit into buf[0] packed & buf[1] decoded
+      const unsigned char *packed = (const unsigned char*)buf[0];
+      size_t got = readFromFile(fd, buf[0], min(buf_size, bytes - offset), offset), used = 0;
+      run = buf[1];
+      n = 0;
+      while (used + BLOCK_HEADER <= got && pos + n < count) {
+        uint32_t key_bytes, payload_bytes;
+        memcpy(&key_bytes, packed + used, sizeof(key_bytes));
+        memcpy(&payload_bytes, packed + used + 4, sizeof(payload_bytes));
+        size_t nbyte = BLOCK_HEADER + key_bytes + payload_bytes, tuples = min(COMPRESS_BLOCK, count - pos - n);
+        if (used + nbyte > got || n + tuples > buf_tuples)
+          break;
+        if (!decodeBlock(packed + used, nbyte, tuples, run + n)) {
+          ok = false;
+          break;
+        }
+        used += nbyte;
+        n    += tuples;
+        file.blocks.push_back(offset + used);
+      }
+      offset += used;
+      ok = ok && n > 0;
+    }
+    if (!ok)
+      break;
+
+    sum += runSum(run, n, pos);
+    for (size_t i = (pos + INDEX_STRIDE - 1) / INDEX_STRIDE * INDEX_STRIDE; i < pos + n; i += INDEX_STRIDE) {
+      file.index.push_back(MERGEKEY());
+      file.index.back().load(run[i - pos]);
+    }
+    if (pos == 0)
+      first = keyHex(run[0]);
+    last = keyHex(run[n-1]);
+    pos += n;
+  }
+  closeFile(fd);
+
+  return ok && (!compressed || offset == bytes) && sum == file.checksum &&
+         first == file.first_key && last == file.last_key;
+}
+
+// loads runs recorded for this input & layout into tmp_files, and starts a new manifest
+// with them. returns which chunks are sorted already.
+inline vector<bool> resumeRuns(int input_fd, TUPLETYPE *buf[2], size_t buf_tuples)
+{
+  struct stat st;
+  char header[256];
+  fstat(input_fd, &st);
+  snprintf(header, sizeof(header), "extsort %lld %lld.%09ld %llu %zu %zu %zu %zu %d %d\n",
+           (long long)st.st_size, (long long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec,
+           (unsigned long long)st.st_ino, chunk_per_file, TUPLE_SIZE, KEY_SIZE, KEY_OFFSET,
+           stable_ties, unique_keys);
+
+  vector<FILEINFO> runs;
+  vector<size_t> bytes;
+  vector<bool> packed;
+  FILE *fp = fopen(MANIFEST_FILE, "r");
+  char *line = NULL;
+  size_t line_size = 0;
+  if (fp != NULL && getline(&line, &line_size, fp) > 0 && strcmp(line, header) == 0) {
+    while (getline(&line, &line_size, fp) > 0) {
+      char name[64], format[8], chunks[strlen(line)], first[2*KEY_SIZE + 1], last[2*KEY_SIZE + 1];
+      size_t tuples, size;
+      unsigned long long sum;
+      if (sscanf(line, "run %63s %7s %s %zu %zu %llx %32s %32s",
+                 name, format, chunks, &tuples, &size, &sum, first, last) != 8)
+        break;// torn by the crash
+      FILEINFO run(name, 0, tuples * TUPLE_SIZE);
+      run.checksum  = sum;
+      run.first_key = first;
+      run.last_key  = last;
+      for (char *c = strtok(chunks, ","); c != NULL; c = strtok(NULL, ","))
+        run.chunks.push_back(atoi(c));
+      for (size_t i = 0; i < runs.size(); ) {// merged from earlier runs: those are gone
+        if (find_first_of(runs[i].chunks.begin(), runs[i].chunks.end(),
+                          run.chunks.begin(), run.chunks.end()) != runs[i].chunks.end()) {
+          runs.erase(runs.begin() + i);
+          bytes.erase(bytes.begin() + i);
+          packed.erase(packed.begin() + i);
+        } else {
+          i++;
+        }
+      }
+      runs.push_back(run);
+      bytes.push_back(size);
+      packed.push_back(strcmp(format, "packed") == 0);
+    }
+  }
+  free(line);
+  if (fp != NULL)
+    fclose(fp);
+
+  vector<bool> done(total_file, false);
+  manifest = fopen(MANIFEST_FILE ".new", "w");
+  if (manifest == NULL) {
+    printf("error: open %s file\n", MANIFEST_FILE ".new");
+    exit(1);
+  }
+  fputs(header, manifest);
+  for (size_t i = 0; i < runs.size(); i++) {
+    next_tmp_file = max(next_tmp_file, atoi(runs[i].file_name.c_str()) + 1);
+    bool chunks_ok = true;
+    for (size_t j = 0; j < runs[i].chunks.size(); j++)
+      chunks_ok = chunks_ok && runs[i].chunks[j] >= 0 && runs[i].chunks[j] < total_file;
+    if (!chunks_ok || !loadRun(runs[i], packed[i], bytes[i], buf, buf_tuples)) {
+      unlink(runs[i].file_name.c_str());
+      continue;
+    }
+    for (size_t j = 0; j < runs[i].chunks.size(); j++)
+      done[runs[i].chunks[j]] = true;
+    tmp_files.push_back(runs[i]);
+    recordRun(runs[i]);
+  }
+  rename(MANIFEST_FILE ".new", MANIFEST_FILE);
+#ifdef VERBOSE
+  printf("resumed %zu runs from %s\n", tmp_files.size(), MANIFEST_FILE);
+#endif
+
+  return done;
+}
+
+#endif
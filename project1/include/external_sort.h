@@ -2,15 +2,24 @@
 #define EXTERNAL_SORT_H
 
 #include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <fcntl.h>
 #include <future>
+#include <getopt.h>
+#include <memory>
 #include <omp.h>
 #include <queue>
+#include <random>
+#include <sched.h>
 #include <string>
+#include <sys/mman.h>
 #include <thread>
+#include <type_traits>
 #include <unistd.h>
 #include <utility>
 #include <vector>
@@ -21,12 +30,102 @@ using namespace std::chrono;
 #endif
 using namespace std;
 
-#define KEY_SIZE        (10UL)
+// record layout: TUPLE_SIZE bytes with a KEY_SIZE bytes key at KEY_OFFSET, compared as
+// unsigned bytes. fixed per build, so key kernels work on constant sizes.
+#ifndef TUPLE_SIZE
 #define TUPLE_SIZE      (100UL)
+#endif
+#ifndef KEY_SIZE
+#define KEY_SIZE        (10UL)
+#endif
+#ifndef KEY_OFFSET
+#define KEY_OFFSET      (0UL)
+#endif
+// defaults of max_threads, file_threshold, buffer_size, w_buffer_size & memory_budget.
+// ./run options or EXTSORT_* environment variables override them at startup.
+#ifndef MAX_THREADS
 #define MAX_THREADS     (16)
+#endif
+#ifndef FILE_THRESHOLD
 #define FILE_THRESHOLD  (1000000000UL)
+#endif
+#ifndef BUFFER_SIZE
 #define BUFFER_SIZE     (100000000UL)
+#endif
+#ifndef W_BUFFER_SIZE
 #define W_BUFFER_SIZE   (200000000UL)
+#endif
+// every tuple buffer alive at once (sort chunk, read & write buffers) must fit in memory_budget.
+#ifndef MEMORY_BUDGET
+#define MEMORY_BUDGET   (1800000000UL)
+#endif
+// smallest read buffer worth issuing; bounds the fan-in of a single merge pass.
+#ifndef MIN_BUFFER_SIZE
+#define MIN_BUFFER_SIZE (4000000UL)
+#endif
+// smallest share of a read buffer given to one merge thread; bounds merge parallelism.
+#ifndef MIN_SLICE_SIZE
+#define MIN_SLICE_SIZE  (1000000UL)
+#endif
+// RADIX_WC: radix passes over ranges of at least this many bytes(much larger than L2) go out
+// of place through write combining buffers(kxsort.h). scratch as large as the chunk is budgeted.
+#ifndef RADIX_WC_MIN
+#define RADIX_WC_MIN    (16000000UL)
+#endif
+// chunks(or tags) made of at most this many sorted runs are merged instead of radix sorted
+// (parallel_sort.h). 0 radix sorts every chunk, even one already in order.
+#ifndef PRESORTED_RUNS
+#define PRESORTED_RUNS  (8)
+#endif
+// items each thread moves per window of an in-place parallel permutation(parallel_sort.h).
+#ifndef PERMUTE_WINDOW
+#define PERMUTE_WINDOW  (4096UL)
+#endif
+// sort chunks alive while generating runs: one is sorted while the other is spilled & refilled.
+#define RUN_BUFFERS     (2)
+// O_DIRECT block size. buffers are aligned to it and partial blocks go through the page cache.
+#ifndef DIRECT_ALIGN
+#define DIRECT_ALIGN    (4096UL)
+#endif
+// unaligned O_DIRECT transfers are copied through a bounce buffer of this size per thread.
+#define DIRECT_BOUNCE   (1048576UL)
+// O_DIRECT twins are kept for fds below this.
+#define DIRECT_FDS      (65536UL)
+// keys sampled per partition to choose splitters of parallelSort().
+#define SAMPLE_PER_PART (64)
+// one key of every INDEX_STRIDE tuples of a run is kept to find partition bounds.
+#define INDEX_STRIDE    (4096UL)
+// COMPRESS_RUNS: tuples per compressed block of a spilled run. a run reader needs one block
+// decoded in a side of its double buffer.
+#ifndef COMPRESS_BLOCK
+#define COMPRESS_BLOCK  (1024UL)
+#endif
+// COMPRESS_RUNS: blocks of spilled runs are encoded a batch at a time in up to 1/COMPRESS_SHARE
+// of the budget(at least one block, at most 4 per thread).
+#ifndef COMPRESS_SHARE
+#define COMPRESS_SHARE  (64UL)
+#endif
+
+static_assert(KEY_SIZE >= 1 && KEY_SIZE <= 16, "KEY_SIZE must be 1 to 16 bytes");
+static_assert(KEY_OFFSET + KEY_SIZE <= TUPLE_SIZE, "key must lie inside the tuple");
+
+// three-way compare of keys as unsigned bytes, like memcmp: first 8 bytes as one big-endian
+// integer, then the 8 bytes that end the key(10 bytes key: 2 new ones, the rest are equal by then).
+inline int keyCompare(const unsigned char *a, const unsigned char *b)
+{
+  if (KEY_SIZE < 8)
+    return memcmp(a, b, KEY_SIZE);
+  uint64_t x, y;
+  memcpy(&x, a, 8);
+  memcpy(&y, b, 8);
+  if (x == y && KEY_SIZE > 8) {
+    memcpy(&x, a + KEY_SIZE - 8, 8);
+    memcpy(&y, b + KEY_SIZE - 8, 8);
+  }
+  if (x == y)
+    return 0;
+  return (__builtin_bswap64(x) < __builtin_bswap64(y) ? -1 : 1);
+}
 
 class TUPLETYPE {
 public:
@@ -40,90 +139,372 @@ public:
 
   bool operator> (const TUPLETYPE &other)
   {
-    if (memcmp(this->binary, other.binary, KEY_SIZE) > 0)
+    if (keyCompare(this->binary + KEY_OFFSET, other.binary + KEY_OFFSET) > 0)
       return true;
     return false;
   }
 };
 
+// compact (key, index) record for TAG_SORT & --stable: radix passes move 16 bytes(100 bytes
+// layout) instead of a whole tuple. tags sort by key, then index, so equal keys keep their order.
+class TAGTYPE {
+public:
+  unsigned char key[KEY_SIZE];
+  uint32_t idx;// position of the tuple in the unsorted chunk
+};
+// tuples a chunk sorted through tags may hold.
+#ifndef MAX_TAG_TUPLES
+#define MAX_TAG_TUPLES  ((size_t)UINT32_MAX)
+#endif
+
+// bytes of the key after the first 8, and an integer wide enough to hold them plus a sentinel bit.
+#define SUFFIX_SIZE     (KEY_SIZE > 8 ? KEY_SIZE - 8 : 0)
+typedef conditional<(SUFFIX_SIZE < 8), uint64_t, unsigned __int128>::type SUFFIXTYPE;
+
+// head key of a run: first 8 bytes big-endian (one integer compare decides most games)
+// and the rest of the key for ties. exhausted runs get a suffix no real key can reach.
+class MERGEKEY {
+  public:
+    uint64_t prefix;
+    SUFFIXTYPE suffix;
+
+    static constexpr SUFFIXTYPE SENTINEL = (SUFFIXTYPE)1 << (8 * SUFFIX_SIZE);
+
+    void load(const unsigned char *key)
+    {
+      if (KEY_SIZE >= 8) {
+        uint64_t raw;
+        memcpy(&raw, key, sizeof(raw));
+        prefix = __builtin_bswap64(raw);
+      } else {// shorter keys are left aligned, so they compare the same
+        prefix = 0;
+        for (size_t i = 0; i < 8; i++)
+          prefix = (prefix << 8) | (i < KEY_SIZE ? key[i] : 0);
+      }
+      suffix = 0;
+      for (size_t i = 8; i < KEY_SIZE; i++)
+        suffix = (suffix << 8) | key[i];
+    }
+    void load(const TUPLETYPE &tuple) { load(tuple.binary + KEY_OFFSET); }
+    void clear() { prefix = UINT64_MAX; suffix = SENTINEL; }
+    bool done() const { return suffix == SENTINEL; }
+    bool operator< (const MERGEKEY &other) const
+    {
+      return prefix < other.prefix || (prefix == other.prefix && suffix < other.suffix);
+    }
+};
+
+// position dependent hash of a tuple. checksum of a run is the sum over its tuples,
+// so each merge thread adds up its own part of the output.
+inline uint64_t tupleSum(const TUPLETYPE &tuple, size_t pos)
+{
+  uint64_t h = pos * 0x9E3779B97F4A7C15ULL;
+  for (size_t i = 0; i < TUPLE_SIZE; i += 8) {
+    uint64_t word = 0;
+    memcpy(&word, tuple.binary + i, min((size_t)8, TUPLE_SIZE - i));
+    h = (h ^ word) * 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 32;
+  }
+  return h;
+}
+
 class FILEINFO {
   public:
     string file_name;
     size_t cur_offset;
     size_t size;
+    TUPLETYPE *head;        // first tuples of the run, kept inmemory instead of the file.
+    size_t preloaded;       // bytes in head
+    vector<MERGEKEY> index; // key of every INDEX_STRIDE-th tuple of the run
+    vector<size_t> blocks;  // compressed run: file offset of each block & the end. empty if plain
+    vector<int> chunks;     // input chunks sorted into the run
+    uint64_t checksum;      // CHECKPOINT: sum of tupleSum() over the run
+    string first_key, last_key;// CHECKPOINT: in hex
 
     FILEINFO() {};
 
-    FILEINFO(string file, size_t offset, size_t size) : file_name(file), cur_offset(offset), size(size) {};
+    FILEINFO(string file, size_t offset, size_t size, TUPLETYPE *head = NULL, size_t preloaded = 0)
+      : file_name(file), cur_offset(offset), size(size), head(head), preloaded(preloaded), checksum(0) {};
+
+    size_t tuples() const { return (preloaded + size) / TUPLE_SIZE; }
+};
+
+// decided once from the input size so that every phase stays inside memory_budget.
+class MERGEPLAN {
+  public:
+    int    runs;      // sorted runs produced by the read & sort phase
+    int    fan_in;    // runs merged at once
+    int    passes;    // merge passes including the final one
+    int    threads;   // key range partitions merged in parallel
+    size_t run_buf;   // bytes per side of each run's double read buffer, sliced between threads
+    size_t preload;   // bytes of each spilled run's head kept inmemory
+    bool   keep_last; // last run stays in `tuples` and heads of spilled runs are preloaded
+
+    MERGEPLAN() {};
+};
+
+class URING;
+
+// one outstanding read or write of a run. goes through the merge thread's io_uring
+// if it has one, otherwise a blocking pread/pwrite runs on another thread.
+class PENDINGIO {
+  public:
+    bool active;
+
+    PENDINGIO() : active(false), ring(NULL) {};
+
+    void read(URING *ring, int fd, void *buf, size_t nbyte, size_t offset);
+    void write(URING *ring, int fd, const void *buf, size_t nbyte, size_t offset);
+    size_t get();
+
+  private:
+    URING *ring;
+    int slot;
+    bool writing;
+    future<size_t> result;
+};
+
+// double buffered sequential reader over tuples [start, end) of one sorted run.
+// preloaded head of the run is read inmemory first, the rest from the file.
+class RUNREADER {
+  public:
+    TUPLETYPE *buf[2];
+    size_t buf_size;    // capacity of each side in bytes
+    TUPLETYPE *data;    // tuples being merged: preloaded head or one side of buf
+    size_t len;
+    size_t pos;
+    int side;           // side of buf the next read goes into
+    int fd;
+    size_t offset;      // next file offset to read (of the decoded run, if compressed)
+    size_t size;        // file offset to stop reading at
+    size_t skip[2];     // bytes before the first tuple of each side (O_DIRECT reads whole blocks)
+    size_t want[2];     // tuple bytes asked for each side
+    const FILEINFO *file;
+    size_t first, last; // compressed run: blocks being read into side 0, decoded into side 1
+    size_t group;       // decoded offset the blocks being read are merged from
+    URING *ring;
+    PENDINGIO pending;
+
+    RUNREADER() : fd(-1), file(NULL), ring(NULL) {};
+
+    // queues the first read only. start() waits for it, so reads of every run go out together.
+    void open(const FILEINFO &file, size_t start, size_t end,
+              TUPLETYPE *buf0, TUPLETYPE *buf1, size_t buf_size, URING *ring = NULL);
+    void openMemory(TUPLETYPE *run, size_t count);
+    void start() { if (empty()) advance(); }
+    void close();
+    bool empty() { return pos >= len; }
+    TUPLETYPE* head() { return &data[pos]; }
+    bool next()
+    {
+      if (++pos < len)
+        return true;
+      return advance();
+    }
+
+  private:
+    bool advance();
+    void fill();
 };
 
+// double buffered sequential writer, flushing one side while the other fills up.
+class RUNWRITER {
+  public:
+    TUPLETYPE *buf[2];
+    TUPLETYPE *data;    // where tuples of the current side go
+    size_t cap;         // tuples per side
+    size_t idx;
+    int cur;
+    int fd;
+    size_t offset;
+    vector<MERGEKEY> *index;// filled with every INDEX_STRIDE-th key by file position, if set
+    uint64_t sum;       // CHECKPOINT: tupleSum() of the tuples pushed
+    URING *ring;
+    PENDINGIO pending;
+
+    RUNWRITER(int fd, TUPLETYPE *buf0, TUPLETYPE *buf1, size_t buf_size, size_t offset = 0,
+              vector<MERGEKEY> *index = NULL, URING *ring = NULL);
+
+    void push(const TUPLETYPE &tuple)
+    {
+      if (index != NULL && (offset / TUPLE_SIZE + idx) % INDEX_STRIDE == 0) {
+        index->push_back(MERGEKEY());
+        index->back().load(tuple);
+      }
+#ifdef CHECKPOINT
+      sum += tupleSum(tuple, offset / TUPLE_SIZE + idx);
+#endif
+      data[idx++] = tuple;
+      if (idx == cap)
+        flush();
+    }
+    void flush();
+    void finish();
+
+  private:
+    TUPLETYPE* place(TUPLETYPE *side);
+};
+
+inline const unsigned char* keyOf(const TUPLETYPE &tuple) { return tuple.binary + KEY_OFFSET; }
+inline const unsigned char* keyOf(const TAGTYPE &tag) { return tag.key; }
+void countBytes(const void *items, size_t stride, size_t offset, size_t n, size_t *count);
+
+// whole key, most significant byte first.
+template <class T>
 struct RadixTraits
 {
-    static const int nBytes = KEY_SIZE - 1;
+    static const int nBytes = KEY_SIZE;
 
-    int kth_byte(const TUPLETYPE& x, int k) {
-        return x.binary[KEY_SIZE - 2 - k] & ((unsigned char) 0xFF);
+    int kth_byte(const T& x, int k) {
+        return keyOf(x)[KEY_SIZE - 1 - k] & ((unsigned char) 0xFF);
     }
-    bool compare(const TUPLETYPE& k1, const TUPLETYPE& k2) {
-        return (memcmp(k1.binary, k2.binary, KEY_SIZE) < 0);
+    bool compare(const T& k1, const T& k2) {
+        return (keyCompare(keyOf(k1), keyOf(k2)) < 0);
+    }
+    void histogram(const T* s, const T* e, int k, size_t *count) {
+        countBytes(s, sizeof(T), keyOf(*s) - (const unsigned char*)s + KEY_SIZE - 1 - k, e - s, count);
     }
 };
 
-struct OneByteRadixTraits
+// tags: index bytes after the key, least significant last.
+template <>
+struct RadixTraits<TAGTYPE>
 {
-    static const int nBytes = 1;
+    static const int nBytes = KEY_SIZE + sizeof(uint32_t);
 
-    int kth_byte(const TUPLETYPE& x, int k) {
-        return x.binary[k] & ((unsigned char) 0xFF);
+    int kth_byte(const TAGTYPE& x, int k) {
+        return k < (int)sizeof(uint32_t) ? (x.idx >> (8 * k)) & 0xFF : x.key[KEY_SIZE - 1 - (k - sizeof(uint32_t))];
+    }
+    bool compare(const TAGTYPE& k1, const TAGTYPE& k2) {
+        int cmp = keyCompare(k1.key, k2.key);
+        return cmp < 0 || (cmp == 0 && k1.idx < k2.idx);
     }
-    bool compare(const TUPLETYPE& k1, const TUPLETYPE& k2) {
-        return (memcmp(k1.binary, k2.binary, KEY_SIZE) < 0);
+    void histogram(const TAGTYPE* s, const TAGTYPE* e, int k, size_t *count) {// idx is little endian
+        size_t offset = (k < (int)sizeof(uint32_t) ? offsetof(TAGTYPE, idx) + k
+                                                   : KEY_SIZE - 1 - (k - sizeof(uint32_t)));
+        countBytes(s, sizeof(TAGTYPE), offset, e - s, count);
     }
 };
 
+// tournament tree of losers over the head tuple of each run.
+// tree[0] holds the winner, tree[1..count-1] the loser of each game, leaf i sits at i+count.
+class LOSERTREE {
+  public:
+    LOSERTREE(RUNREADER *runs, int count, const int *rank = NULL);
+
+    bool empty() { return count == 0 || key[tree[0]].done(); }
+    int top() { return tree[0]; }
+    const MERGEKEY& topKey() { return key[tree[0]]; }
+    void pop();
+
+  private:
+    RUNREADER *runs;
+    int count;
+    const int *rank;    // --stable: equal keys go to the run of lower rank(earlier input) first
+    vector<int> tree;
+    vector<MERGEKEY> key;
+
+    int build(int node);
+    bool beats(int a, int b)
+    {
+      return key[a] < key[b] || (rank != NULL && rank[a] < rank[b] && !(key[b] < key[a]));
+    }
+};
+
+int    max_threads    = MAX_THREADS;
+size_t file_threshold = FILE_THRESHOLD;// chunk size; input up to 2 chunks is sorted inmemory
+size_t buffer_size    = BUFFER_SIZE;   // max bytes per side of a run's double read buffer
+size_t w_buffer_size  = W_BUFFER_SIZE; // bytes per side of the double write buffer
+size_t memory_budget  = MEMORY_BUDGET;
 TUPLETYPE *tuples;
-thread th[MAX_THREADS];
+TUPLETYPE *mapped;// input mapped by MMAP_INPUT
+TAGTYPE *tags;
 vector<FILEINFO> tmp_files;
+MERGEPLAN merge_plan;
+vector<int> direct_fd(DIRECT_FDS, -1);// O_DIRECT twin of each fd, -1 if none
+FILE *manifest;// CHECKPOINT: finished runs are recorded here, NULL if not
+bool use_uring;// merge I/O goes through io_uring. probed at startup, pread/pwrite otherwise.
 int total_file;
+int next_tmp_file;
 size_t total_tuples;
 size_t chunk_per_file;
-size_t chunk_per_thread;
+size_t inmemory_tuples;
+int inmemory_chunk;// chunk the inmemory run was sorted from
+bool stable_ties;  // --stable: equal keys keep their input order
+bool unique_keys;  // --unique: only the first tuple of each key is written
+size_t top_tuples; // -k: only the smallest top_tuples tuples are written, 0 for all
+MERGEKEY range_from, range_to;// --from / --to: only keys in [range_from, range_to) are written
+bool select_range; // --from or --to given
+#ifdef RADIX_WC
+size_t radix_wc_min = RADIX_WC_MIN;// bytes of a range sorted out of place, 0 for never
+#else
+size_t radix_wc_min = 0;
+#endif
 
+int configure(int argc, char* argv[]);
+size_t parseSize(const char *str);
+void autoTune();
+size_t runTuples();
+bool sortsInMemory(size_t tuples);
+MERGEPLAN planMerge(int runs, size_t run_size, size_t sort_size);
+bool sortsTags();
+size_t sortOverhead(bool tagged);
+void sortChunk(TUPLETYPE* tuples, size_t count);
 void parallelSort(TUPLETYPE* tuples, size_t count);
-void externalSort(int output_fd, TUPLETYPE* read_buf[][2]);
+void tagSort(const TUPLETYPE* tuples, size_t count, TAGTYPE* tags);
+void gatherTuples(const TUPLETYPE* tuples, const TAGTYPE* tags, size_t count, TUPLETYPE* out);
+void permuteTuples(TUPLETYPE* tuples, TAGTYPE* tags, size_t count);
+void parallelRead(int fd, TUPLETYPE *buf, size_t count, size_t offset);
+TUPLETYPE* mapInput(int fd, size_t nbyte);
+void gatherToFile(int fd, const TUPLETYPE *tuples, const TAGTYPE *tags, size_t count);
+void generateRuns(int input_fd, bool stream);
+void spillRun(TUPLETYPE *run, size_t count, bool preload, int chunk);
+size_t externalSort(int output_fd, TUPLETYPE* read_buf[][2]);
+size_t parallelMerge(int count, bool with_memory_run, TUPLETYPE* read_buf[][2],
+                     TUPLETYPE* write_buf[2], int out_fd, FILEINFO *out);
+size_t closeGaps(int fd, const vector<size_t> &start, const vector<size_t> &written, TUPLETYPE *buf,
+                 size_t buf_size, vector<vector<MERGEKEY> > &index_part, vector<uint64_t> &sum_part);
+size_t runLowerBound(const FILEINFO &file, int fd, const MERGEKEY &key);
+void mergeRuns(RUNREADER *runs, int count, RUNWRITER &out, const int *rank);
+bool parseKey(const char *hex, MERGEKEY &key);
+bool selects();
+size_t cutSelected(TUPLETYPE *tuples, size_t count);
+size_t selectTuples(int fd, bool stream);
+bool probeUring();
+int openFile(const char *path, int flags, mode_t mode = 0);
+void closeFile(int fd);
+int directFd(int fd);
+bool seekable(int fd);
+size_t alignOf(int fd);
+char* alignUp(void *ptr, size_t align);
+TUPLETYPE* allocTuples(size_t count);
+void freeTuples(TUPLETYPE *tuples);
 size_t readFromFile(int fd, void *buf, size_t nbyte, size_t offset);
 size_t writeToFile(int fd, const void *buf, size_t nbyte, size_t offset);
 void printKey(TUPLETYPE tuple);
 
-struct pq_cmp {
-    bool operator()(pair<TUPLETYPE*, pair<int, size_t> > &t1, pair<TUPLETYPE*, pair<int, size_t> > &t2)
-    {
-      return *t1.first > *t2.first;
-    }
-};
-
 bool operator< (const TUPLETYPE &k1,const TUPLETYPE &k2)
 {
-  if (memcmp(k1.binary, k2.binary, KEY_SIZE) < 0)
+  if (keyCompare(keyOf(k1), keyOf(k2)) < 0)
     return true;
   return false;
 }
 
 bool operator<= (const TUPLETYPE &k1,const TUPLETYPE &k2) {
-  if (memcmp(k1.binary, k2.binary, KEY_SIZE) <= 0)
+  if (keyCompare(keyOf(k1), keyOf(k2)) <= 0)
     return true;
   return false;
 }
 
 bool operator> (const TUPLETYPE &k1,const TUPLETYPE &k2)
 {
-  if (memcmp(k1.binary, k2.binary, KEY_SIZE) > 0)
+  if (keyCompare(keyOf(k1), keyOf(k2)) > 0)
     return true;
   return false;
 }
 
 bool operator>= (const TUPLETYPE &k1,const TUPLETYPE &k2) {
-  if (memcmp(k1.binary, k2.binary, KEY_SIZE) >= 0)
+  if (keyCompare(keyOf(k1), keyOf(k2)) >= 0)
     return true;
   return false;
 }
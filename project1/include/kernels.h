@@ -0,0 +1,132 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include "external_sort.h"
+#include <chrono>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// byte histograms of radix passes: count[b] += items whose byte at `offset` is b.
+// items are `stride` bytes apart(a tuple or a tag), so every count is a load and an add to
+// memory. a run of equal bytes(skewed or presorted keys) makes each add wait for the one
+// before through store forwarding, so neighbours go to 4 separate tables that are summed
+// at the end. AVX2 also gathers the bytes of 8 items with one load. the kernel is picked
+// once at runtime; RADIX_SCALAR keeps the single table loop for comparison.
+#define HISTOGRAM_TABLES  (4)
+// below this, zeroing & summing the extra tables costs more than the stalls they avoid.
+#define HISTOGRAM_MIN     (1024UL)
+
+inline void countBytesPlain(const unsigned char *items, size_t stride, size_t offset, size_t n, size_t *count)
+{
+  for (size_t i = 0; i < n; i++)
+    count[items[i * stride + offset]]++;
+}
+
+inline void countBytesTables(const unsigned char *items, size_t stride, size_t offset, size_t n, size_t *count)
+{
+  uint32_t table[HISTOGRAM_TABLES][256] = {{0}};
+  const unsigned char *p = items + offset;
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4, p += 4 * stride) {
+    table[0][p[0]]++;
+    table[1][p[stride]]++;
+    table[2][p[2 * stride]]++;
+    table[3][p[3 * stride]]++;
+  }
+  for (; i < n; i++, p += stride)
+    table[0][p[0]]++;
+  for (int b = 0; b < 256; b++)
+    count[b] += (size_t)table[0][b] + table[1][b] + table[2][b] + table[3][b];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// gathers 4 bytes around each wanted one, from inside the item: the byte and the 3 after it
+// if it is near the item's start, else the 3 before it and the byte.
+__attribute__((target("avx2")))
+inline void countBytesAVX2(const unsigned char *items, size_t stride, size_t offset, size_t n, size_t *count)
+{
+  uint32_t table[HISTOGRAM_TABLES][256] = {{0}};
+  const bool low = (offset < 3);
+  const int shift = (low ? 0 : 24);
+  const unsigned char *p = items + (low ? offset : offset - 3);
+  const __m256i index = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                           _mm256_set1_epi32((int)stride));
+  const __m256i mask = _mm256_set1_epi32(0xFF);
+  alignas(32) uint32_t b[8];
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8, p += 8 * stride) {
+    __m256i v = _mm256_i32gather_epi32((const int*)p, index, 1);
+    _mm256_store_si256((__m256i*)b, _mm256_and_si256(_mm256_srli_epi32(v, shift), mask));
+    table[0][b[0]]++;
+    table[1][b[1]]++;
+    table[2][b[2]]++;
+    table[3][b[3]]++;
+    table[0][b[4]]++;
+    table[1][b[5]]++;
+    table[2][b[6]]++;
+    table[3][b[7]]++;
+  }
+  for (; i < n; i++)
+    table[0][items[i * stride + offset]]++;
+  for (int b = 0; b < 256; b++)
+    count[b] += (size_t)table[0][b] + table[1][b] + table[2][b] + table[3][b];
+}
+#endif
+
+enum HISTOGRAM { PLAIN, TABLES, AVX2 };
+
+inline void countBytes(const void *items, size_t stride, size_t offset, size_t n, size_t *count,
+                       HISTOGRAM kernel);
+
+// gathers are slower than scalar loads on some CPUs with AVX2, so where it is supported both
+// kernels count a small block of tuples once, and the faster one is kept.
+inline HISTOGRAM histogramKernel()
+{
+#ifdef RADIX_SCALAR
+  return PLAIN;
+#elif defined(__x86_64__) || defined(__i386__)
+  static const HISTOGRAM kernel = []() {
+    if (!__builtin_cpu_supports("avx2"))
+      return TABLES;
+    const size_t n = 16 * HISTOGRAM_MIN;
+    vector<unsigned char> block(n * TUPLE_SIZE);
+    mt19937_64 gen(n);
+    for (size_t i = 0; i < block.size(); i++)
+      block[i] = gen();
+    uint64_t best[2] = {UINT64_MAX, UINT64_MAX};
+    for (int round = 0; round < 3; round++)
+      for (int k = 0; k < 2; k++) {
+        size_t count[256] = {0};
+        auto start = chrono::steady_clock::now();
+        countBytes(block.data(), TUPLE_SIZE, KEY_OFFSET, n, count, (k ? AVX2 : TABLES));
+        best[k] = min(best[k], (uint64_t)(chrono::steady_clock::now() - start).count());
+      }
+    return (best[1] < best[0] ? AVX2 : TABLES);
+  }();
+  return kernel;
+#else
+  return TABLES;
+#endif
+}
+
+inline void countBytes(const void *items, size_t stride, size_t offset, size_t n, size_t *count,
+                       HISTOGRAM kernel)
+{
+  const unsigned char *bytes = (const unsigned char*)items;
+  if (kernel == PLAIN || n < HISTOGRAM_MIN || n >= UINT32_MAX)
+    countBytesPlain(bytes, stride, offset, n, count);
+#if defined(__x86_64__) || defined(__i386__)
+  else if (kernel == AVX2 && stride >= 8 && stride * 8 <= INT32_MAX)
+    countBytesAVX2(bytes, stride, offset, n, count);
+#endif
+  else
+    countBytesTables(bytes, stride, offset, n, count);
+}
+
+inline void countBytes(const void *items, size_t stride, size_t offset, size_t n, size_t *count)
+{
+  countBytes(items, stride, offset, n, count, histogramKernel());
+}
+
+#endif
@@ -27,6 +27,12 @@
 
 #include <iterator>
 #include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#endif
 
 namespace kx {
 
@@ -34,6 +40,8 @@ static const int kRadixBits = 8;
 static const size_t kInsertSortThreshold = 64;
 static const int kRadixMask = (1 << kRadixBits) - 1;
 static const int kRadixBin = 1 << kRadixBits;
+// bytes of the write combining buffer of each bucket in out-of-place passes.
+static const size_t kWcBytes = 512;
 
 //================= HELPING FUNCTIONS ====================
 
@@ -42,6 +50,10 @@ struct RadixTraitsUnsigned {
     static const int nBytes = sizeof(T);
     int kth_byte (const T &x, int k) { return (x >> (kRadixBits * k)) & kRadixMask; }
     bool compare(const T &x, const T &y) { return x < y; }
+    template <class RandomIt>
+    void histogram(RandomIt s, RandomIt e, int k, size_t *count) {
+        for (; s < e; ++s) ++count[kth_byte(*s, k)];
+    }
 };
 
 template<class T>
@@ -52,6 +64,10 @@ struct RadixTraitsSigned {
         return ((x ^ kMSB) >> (kRadixBits * k)) & kRadixMask;
     }
     bool compare(const T &x, const T &y) { return x < y; }
+    template <class RandomIt>
+    void histogram(RandomIt s, RandomIt e, int k, size_t *count) {
+        for (; s < e; ++s) ++count[kth_byte(*s, k)];
+    }
 };
 
 template <class RandomIt, class ValueType, class RadixTraits>
@@ -77,9 +93,8 @@ inline void radix_sort_core_(RandomIt s, RandomIt e, RadixTraits radix_traits)
     RandomIt *last = last_ + 1;
     size_t count[kRadixBin] = {0};
 
-    for (RandomIt i = s; i < e; ++i) {
-        ++count[radix_traits.kth_byte(*i, kWhichByte)];
-    }
+    // traits count the bytes themselves, so they can use a faster kernel.
+    radix_traits.histogram(s, e, kWhichByte, count);
 
     last_[0] = last_[1] = s;
 
@@ -116,6 +131,78 @@ inline void radix_sort_core_(RandomIt s, RandomIt e, RadixTraits radix_traits)
     }
 }
 
+// copy with non-temporal stores where 16 bytes aligned, so a flushed buffer goes to memory
+// without reading the destination lines into cache first.
+inline void stream_copy_(void *to, const void *from, size_t n)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    char *d = (char*)to;
+    const char *f = (const char*)from;
+    size_t head = std::min(n, (16 - (uintptr_t)d % 16) % 16);
+    memcpy(d, f, head);
+    for (size_t i = head; i + 16 <= n; i += 16)
+        _mm_stream_si128((__m128i*)(d + i), _mm_loadu_si128((const __m128i*)(f + i)));
+    size_t tail = head + (n - head) / 16 * 16;
+    memcpy(d + tail, f + tail, n - tail);
+#else
+    memcpy(to, from, n);
+#endif
+}
+
+// out-of-place pass for ranges much larger than cache(at least wc_min items): items are
+// scattered into scratch through a buffer of kWcBytes per bucket, flushed a few cache lines at
+// a time, so every bucket is written in sequence instead of one item at a time at random.
+// each bucket is sorted further inside scratch(with its share of [s, e) as scratch) and
+// copied back while it is still in cache.
+template <class ValueType, class RadixTraits, int kWhichByte>
+inline void radix_sort_wc_(ValueType *s, ValueType *e, ValueType *scratch, RadixTraits radix_traits,
+                           size_t wc_min)
+{
+    const size_t kWcItems = std::max((size_t)4, kWcBytes / sizeof(ValueType));
+    size_t count[kRadixBin] = {0};
+    size_t next[kRadixBin], fill[kRadixBin] = {0};
+    ValueType *wc = (ValueType*)aligned_alloc(64, (kRadixBin * kWcItems * sizeof(ValueType) + 63) / 64 * 64);
+    if (wc == NULL) {// in place then
+        radix_sort_core_<ValueType*, ValueType, RadixTraits, kWhichByte>(s, e, radix_traits);
+        return;
+    }
+
+    radix_traits.histogram(s, e, kWhichByte, count);
+    next[0] = 0;
+    for (int i = 1; i < kRadixBin; ++i)
+        next[i] = next[i-1] + count[i-1];
+
+    for (ValueType *i = s; i < e; ++i) {
+        int tag = radix_traits.kth_byte(*i, kWhichByte);
+        ValueType *buf = wc + tag * kWcItems;
+        buf[fill[tag]++] = *i;
+        if (fill[tag] == kWcItems) {
+            stream_copy_(scratch + next[tag], buf, kWcItems * sizeof(ValueType));
+            next[tag] += kWcItems;
+            fill[tag] = 0;
+        }
+    }
+    for (int i = 0; i < kRadixBin; ++i)
+        memcpy(scratch + next[i], wc + i * kWcItems, fill[i] * sizeof(ValueType));
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_sfence();
+#endif
+    free(wc);
+
+    for (size_t i = 0, start = 0; i < kRadixBin; start += count[i++]) {
+        ValueType *b = scratch + start;
+        if (kWhichByte > 0 && count[i] >= wc_min)
+            radix_sort_wc_<ValueType, RadixTraits, (kWhichByte > 0 ? (kWhichByte - 1) : 0)>
+                (b, b + count[i], s + start, radix_traits, wc_min);
+        else if (kWhichByte > 0 && count[i] > kInsertSortThreshold)
+            radix_sort_core_<ValueType*, ValueType, RadixTraits, (kWhichByte > 0 ? (kWhichByte - 1) : 0)>
+                (b, b + count[i], radix_traits);
+        else if (kWhichByte > 0 && count[i] > 1)
+            insert_sort_core_<ValueType*, ValueType, RadixTraits>(b, b + count[i], radix_traits);
+        memcpy(s + start, b, count[i] * sizeof(ValueType));
+    }
+}
+
 template <class RandomIt, class ValueType, class RadixTraits>
 inline void radix_sort_entry_(RandomIt s, RandomIt e, ValueType*,
                               RadixTraits radix_traits)
@@ -138,6 +225,16 @@ inline void radix_sort_entry_(RandomIt s, RandomIt e, ValueType *)
 
 //================= INTERFACES ====================
 
+// passes over at least wc_min items go out of place through scratch(as many items as [s, e)).
+template <class ValueType, class RadixTraits>
+inline void radix_sort(ValueType *s, ValueType *e, RadixTraits radix_traits, ValueType *scratch, size_t wc_min)
+{
+    if ((size_t)(e - s) < std::max(wc_min, kInsertSortThreshold + 1))
+        radix_sort_entry_(s, e, (ValueType*)(0), radix_traits);
+    else
+        radix_sort_wc_<ValueType, RadixTraits, RadixTraits::nBytes - 1>(s, e, scratch, radix_traits, wc_min);
+}
+
 template <class RandomIt, class RadixTraits>
 inline void radix_sort(RandomIt s, RandomIt e, RadixTraits radix_traits)
 {
@@ -0,0 +1,492 @@
+#ifndef PARALLEL_SORT_H
+#define PARALLEL_SORT_H
+
+#include "external_sort.h"
+#include "arena.h"
+#include "kernels.h"
+#include "kxsort.h"
+#include "stats.h"
+#include "topology.h"
+
+// pick parts-1 splitters from a random sample of keys.
+template <class T>
+inline void chooseSplitters(const T* items, size_t count, MERGEKEY* splitter, int parts)
+{
+  vector<MERGEKEY> sample(min(count, (size_t)parts * SAMPLE_PER_PART));
+  mt19937_64 gen(count);
+
+  for (size_t i = 0; i < sample.size(); i++)
+    sample[i].load(keyOf(items[gen() % count]));
+  sort(sample.begin(), sample.end());
+  for (int p = 1; p < parts; p++)
+    splitter[p-1] = sample[sample.size() * p / parts];
+}
+
+// partition of the key: number of splitters <= key.
+template <class T>
+inline int partitionOf(const T& item, const MERGEKEY* splitter, int parts)
+{
+  MERGEKEY key;
+  key.load(keyOf(item));
+  return upper_bound(splitter, splitter + parts - 1, key) - splitter;
+}
+
+// move items into parts contiguous key ranges in place. bound[p] is where part p starts.
+// every thread counts its own block, then owns one stripe of every part's range and
+// cycle walks items into its own stripes (PARADIS). items left in a foreign part are
+// gathered at the tail of that part and walked again, the last few on one thread.
+template <class T>
+inline void partitionBySplitters(T* items, size_t count, const MERGEKEY* splitter, int parts, size_t* bound)
+{
+  vector<vector<size_t> > hist(max_threads, vector<size_t>(parts + 1, 0));
+  vector<size_t> head(parts), tail(parts);
+
+  #pragma omp parallel for num_threads(max_threads)
+  for (int t = 0; t < max_threads; t++) {
+    PINNED pin(t, max_threads);
+    for (size_t i = count * t / max_threads; i < count * (t+1) / max_threads; i++)
+      hist[t][partitionOf(items[i], splitter, parts) + 1]++;
+  }
+  fill(bound, bound + parts + 1, 0);
+  for (int p = 0; p < parts; p++) {
+    bound[p+1] = bound[p];
+    for (int t = 0; t < max_threads; t++)
+      bound[p+1] += hist[t][p+1];
+    head[p] = bound[p];
+    tail[p] = bound[p+1];
+  }
+
+  for (size_t left = count, placed = count; left >= (size_t)max_threads * parts && placed > 0; ) {
+    #pragma omp parallel for num_threads(max_threads)
+    for (int t = 0; t < max_threads; t++) {
+      vector<size_t> next(parts), end(parts);
+      for (int p = 0; p < parts; p++) {
+        next[p] = head[p] + (tail[p] - head[p]) * t / max_threads;
+        end[p]  = head[p] + (tail[p] - head[p]) * (t+1) / max_threads;
+      }
+      for (int p = 0; p < parts; p++) {
+        while (next[p] < end[p]) {
+          T swapper = items[next[p]];
+          int tag = partitionOf(swapper, splitter, parts);
+          while (tag != p && next[tag] < end[tag]) {
+            swap(swapper, items[next[tag]++]);
+            tag = partitionOf(swapper, splitter, parts);
+          }
+          items[next[p]++] = swapper;// may still be foreign if its stripe is full
+        }
+      }
+    }
+
+    // move items that landed in their own part to the front of its unfinished range.
+    placed = 0;
+    #pragma omp parallel for num_threads(max_threads) reduction(+:placed)
+    for (int p = 0; p < parts; p++) {
+      size_t lo = head[p], hi = tail[p];
+      while (lo < hi) {
+        if (partitionOf(items[lo], splitter, parts) == p)
+          lo++;
+        else if (partitionOf(items[hi-1], splitter, parts) != p)
+          hi--;
+        else
+          swap(items[lo++], items[--hi]);
+      }
+      placed += lo - head[p];
+      head[p] = lo;
+    }
+    left -= placed;
+  }
+
+  // whatever is left: same cycle walk on one thread.
+  for (int p = 0; p < parts; p++) {
+    while (head[p] < tail[p]) {
+      T swapper = items[head[p]];
+      int tag = partitionOf(swapper, splitter, parts);
+      if (tag != p) {
+        do {
+          swap(swapper, items[head[tag]++]);
+        } while ((tag = partitionOf(swapper, splitter, parts)) != p);
+        items[head[p]] = swapper;
+      }
+      head[p]++;
+    }
+  }
+}
+
+// where items of a permutation are: get(k) is the position item k of the result is at now.
+// 32 bit indices(merge order), or the idx of sorted tags.
+class INDEXES {
+  public:
+    uint32_t *index;
+    size_t get(size_t k) const { return index[k]; }
+    void set(size_t k, size_t v) { index[k] = v; }
+};
+
+class TAGINDEXES {
+  public:
+    TAGTYPE *tags;
+    size_t get(size_t k) const { return tags[k].idx; }
+    void set(size_t k, size_t v) { tags[k].idx = v; }
+};
+
+// keys of sorted tags are not needed any more: they hold the inverse while tuples are permuted.
+class TAGKEYS {
+  public:
+    TAGTYPE *tags;
+    size_t get(size_t p) const
+    {
+      uint32_t v = 0;
+      memcpy(&v, tags[p].key, min(KEY_SIZE, sizeof(v)));
+      return v;
+    }
+    void set(size_t p, size_t v)
+    {
+      uint32_t k = v;
+      memcpy(tags[p].key, &k, min(KEY_SIZE, sizeof(k)));
+    }
+};
+
+// item k of the result is the one at from.get(k), in place, by walking each cycle of the
+// permutation once on one thread. from is consumed.
+template <class T, class FROM>
+inline void permuteSerial(T* items, size_t count, FROM from)
+{
+  for (size_t i = 0; i < count; i++) {
+    if (from.get(i) == i)
+      continue;
+    T tmp = items[i];
+    size_t j = i;
+    for (size_t k = from.get(j); k != i; k = from.get(j)) {
+      items[j] = items[k];
+      from.set(j, j);
+      j = k;
+    }
+    items[j] = tmp;
+    from.set(j, j);
+  }
+}
+
+// the same in parallel, a window of PERMUTE_WINDOW items per thread at a time, front to back.
+// a window gathers its items into scratch, which frees the places they were at. items of the
+// window's range that are still needed move into those places(`where` is the inverse of from),
+// then scratch is copied over the range. an item moves at most twice, and scratch is a window.
+template <class T, class FROM, class WHERE>
+inline void permuteParallel(T* items, size_t count, FROM from, WHERE where)
+{
+  const size_t window = min(count, (size_t)max_threads * PERMUTE_WINDOW);
+  T *scratch = (T*)allocTuples((window * sizeof(T) + TUPLE_SIZE - 1) / TUPLE_SIZE);
+  vector<vector<size_t> > freed(max_threads), moved(max_threads);
+  vector<size_t> at_freed(max_threads + 1, 0), at_moved(max_threads + 1, 0);
+
+  #pragma omp parallel for num_threads(max_threads)
+  for (int t = 0; t < max_threads; t++) {
+    for (size_t k = count * t / max_threads; k < count * (t+1) / max_threads; k++)
+      where.set(from.get(k), k);
+    freed[t].reserve(window / max_threads + 1);
+    moved[t].reserve(window / max_threads + 1);
+  }
+
+  // items of [0, start) are in place, and the rest are at start or after.
+  for (size_t start = 0; start < count; start += window) {
+    const size_t n = min(window, count - start), end = start + n;
+    #pragma omp parallel for num_threads(max_threads)
+    for (int t = 0; t < max_threads; t++) {
+      freed[t].clear();
+      moved[t].clear();
+      for (size_t k = start + n * t / max_threads; k < start + n * (t+1) / max_threads; k++) {
+        size_t p = from.get(k);
+        scratch[k - start] = items[p];
+        if (p >= end)
+          freed[t].push_back(p);
+        if (where.get(k) >= end)// the item at k belongs after the window
+          moved[t].push_back(k);
+      }
+    }
+    for (int t = 0; t < max_threads; t++) {// as many items leave the range as come into it
+      at_freed[t+1] = at_freed[t] + freed[t].size();
+      at_moved[t+1] = at_moved[t] + moved[t].size();
+    }
+
+    const size_t pairs = at_moved[max_threads];
+    #pragma omp parallel for num_threads(max_threads)
+    for (int t = 0; t < max_threads; t++) {
+      size_t j = pairs * t / max_threads, stop = pairs * (t+1) / max_threads;
+      int a = upper_bound(at_moved.begin(), at_moved.end(), j) - at_moved.begin() - 1;
+      int b = upper_bound(at_freed.begin(), at_freed.end(), j) - at_freed.begin() - 1;
+      for (; j < stop; j++) {
+        while (j >= at_moved[a+1])
+          a++;
+        while (j >= at_freed[b+1])
+          b++;
+        size_t p = moved[a][j - at_moved[a]], q = freed[b][j - at_freed[b]], k = where.get(p);
+        items[q] = items[p];
+        from.set(k, q);
+        where.set(q, k);
+      }
+    }
+
+    #pragma omp parallel for num_threads(max_threads)
+    for (int t = 0; t < max_threads; t++)
+      memcpy(items + start + n * t / max_threads, scratch + n * t / max_threads,
+             (n * (t+1) / max_threads - n * t / max_threads) * sizeof(T));
+  }
+  freeTuples((TUPLETYPE*)scratch);
+}
+
+// where the sorted runs of items start, in bound(count last), when there are at most
+// PRESORTED_RUNS of them. each thread scans its block for neighbours out of order, and gives
+// up once its block goes both up and down more than PRESORTED_RUNS times, so a random chunk
+// costs a few compares per thread. one run is PRESORTED, a chunk that never goes up REVERSED.
+template <class T>
+inline SORTPATH scanOrder(const T* items, size_t count, vector<size_t> &bound)
+{
+  RadixTraits<T> traits;
+  const int threads = (count < (size_t)max_threads * SAMPLE_PER_PART ? 1 : max_threads);
+  vector<vector<size_t> > down(threads);
+  vector<size_t> downs(threads, 0);
+  vector<char> up(threads, 0);
+
+  #pragma omp parallel for num_threads(threads)
+  for (int t = 0; t < threads; t++) {
+    for (size_t i = max((size_t)1, count * t / threads); i < count * (t+1) / threads; i++) {
+      if (traits.compare(items[i], items[i-1])) {
+        if (++downs[t] <= PRESORTED_RUNS)
+          down[t].push_back(i);
+        else if (up[t])
+          break;
+      } else if (!up[t] && traits.compare(items[i-1], items[i])) {
+        up[t] = 1;
+        if (downs[t] > PRESORTED_RUNS)
+          break;
+      }
+    }
+  }
+  size_t total = 0;
+  bool rises = false;
+  for (int t = 0; t < threads; t++) {
+    total += downs[t];
+    rises = rises || up[t];
+  }
+  if (total == 0)
+    return PRESORTED;
+  if (!rises)
+    return REVERSED;
+  if (total + 1 > PRESORTED_RUNS)// runs
+    return RADIXED;
+  bound.assign(1, 0);
+  for (int t = 0; t < threads; t++)
+    bound.insert(bound.end(), down[t].begin(), down[t].end());
+  bound.push_back(count);
+  return MERGED;
+}
+
+// how many of the first k items of merge(a, b) come from a. a wins ties.
+template <class I, class LESS>
+inline size_t mergeSplit(I a, size_t na, I b, size_t nb, size_t k, LESS less)
+{
+  size_t lo = k - min(k, nb), hi = min(k, na);
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (!less(b[k - mid - 1], a[mid]))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// merge the sorted runs of items, bound[r] to bound[r+1], in pairs until one is left. runs
+// are merged as 32 bit indices ping-ponged between order & scratch, so only 8 bytes per item
+// are needed beside them, and items move once at the end, by permutation. every thread takes
+// an equal share of the output of each pair, so all of them work however few runs are left.
+// equal items keep their order.
+template <class T>
+inline void mergeRuns(T* items, size_t count, vector<size_t> bound, uint32_t* order, uint32_t* scratch)
+{
+  uint32_t *from = order, *to = scratch;
+  #pragma omp parallel for num_threads(max_threads)
+  for (int t = 0; t < max_threads; t++)
+    for (size_t i = count * t / max_threads; i < count * (t+1) / max_threads; i++)
+      from[i] = i;
+  while (bound.size() > 2) {
+    const size_t runs = bound.size() - 1;
+    #pragma omp parallel for num_threads(max_threads)
+    for (int t = 0; t < max_threads; t++) {
+      RadixTraits<T> traits;
+      auto less = [&traits, items](uint32_t x, uint32_t y) { return traits.compare(items[x], items[y]); };
+      for (size_t r = 0; r < runs; r += 2) {
+        const size_t mid = bound[min(r + 1, runs)], n = bound[min(r + 2, runs)] - bound[r];
+        const uint32_t *a = from + bound[r], *b = from + mid;
+        const size_t na = mid - bound[r], nb = n - na;
+        const size_t lo = n * t / max_threads, hi = n * (t+1) / max_threads;
+        const size_t alo = mergeSplit(a, na, b, nb, lo, less), ahi = mergeSplit(a, na, b, nb, hi, less);
+        merge(a + alo, a + ahi, b + (lo - alo), b + (hi - ahi), to + bound[r] + lo, less);
+      }
+    }
+    vector<size_t> next;
+    for (size_t r = 0; r < runs; r += 2)
+      next.push_back(bound[r]);
+    next.push_back(count);
+    bound.swap(next);
+    swap(from, to);
+  }
+  // to is free now, and holds where each item goes.
+  if (max_threads > 1)
+    permuteParallel(items, count, INDEXES{from}, INDEXES{to});
+  else
+    permuteSerial(items, count, INDEXES{from});
+}
+
+// chunks already in order are left alone, reversed ones are reversed, and a few sorted runs
+// are merged, if their indices fit in what is left of the arena(sortOverhead counts them). returns false if the
+// chunk still has to be radix sorted. the path taken is counted in stats.sort_paths.
+template <class T>
+inline bool sortPresorted(T* items, size_t count)
+{
+  vector<size_t> bound;
+  SORTPATH path = (PRESORTED_RUNS > 0 && count > 1 ? scanOrder(items, count, bound) : RADIXED);
+  if (path == REVERSED) {
+    #pragma omp parallel for num_threads(max_threads)
+    for (int t = 0; t < max_threads; t++)
+      for (size_t i = count / 2 * t / max_threads; i < count / 2 * (t+1) / max_threads; i++)
+        swap(items[i], items[count - 1 - i]);
+  } else if (path == MERGED) {
+    uint32_t *order = (count <= UINT32_MAX ? (uint32_t*)arena.alloc(count * 2 * sizeof(uint32_t)) : NULL);
+    if (order != NULL) {
+      mergeRuns(items, count, bound, order, order + count);
+      arena.release(order);
+    } else {
+      path = RADIXED;
+    }
+  }
+  STATS::add(stats.sort_paths[path], 1);
+  return path != RADIXED;
+}
+
+// items are split into max_threads key ranges by sampled splitters, so every thread
+// gets about the same share whatever the key distribution is. then each thread
+// radix sorts its own range. works on whole tuples (TUPLETYPE) or on tags (TAGTYPE).
+template <class T>
+inline void parallelRadixSort(T* items, size_t count)
+{
+  uint64_t start = STATS::now();
+  if (stats.sort_ns.size() < (size_t)max_threads)
+    stats.sort_ns.resize(max_threads, 0);
+  if (sortPresorted(items, count)) {
+    stats.sort_ns[0] += STATS::now() - start;
+    return;
+  }
+  if (count < (size_t)max_threads * SAMPLE_PER_PART) {
+    kx::radix_sort(items, items+count, RadixTraits<T>());
+    stats.sort_ns[0] += STATS::now() - start;
+    return;
+  }
+
+  vector<MERGEKEY> splitter(max_threads);
+  vector<size_t> partition(max_threads + 1);
+  chooseSplitters(items, count, &splitter[0], max_threads);
+  partitionBySplitters(items, count, &splitter[0], max_threads, &partition[0]);
+  stats.partition_ns += STATS::now() - start;
+#ifdef VERBOSE
+  cout << "partition took " << (STATS::now() - start) / 1000000 << "ms\n";
+#endif
+
+  // RADIX_WC: ranges of at least radix_wc_min bytes go out of place, each into its own part of
+  // scratch, since they are sorted at once. scratch comes from the arena; if it does not fit,
+  // every range is sorted in place.
+  const size_t wc_min = (radix_wc_min > 0 ? max((size_t)1, radix_wc_min / sizeof(T)) : SIZE_MAX);
+  vector<size_t> part(max_threads + 1, 0);
+  for (int i = 0; i < max_threads; i++)
+    part[i+1] = part[i] + (partition[i+1] - partition[i] >= wc_min ? partition[i+1] - partition[i] : 0);
+  T *scratch = (part[max_threads] > 0 ? (T*)arena.alloc(part[max_threads] * sizeof(T)) : NULL);
+
+  #pragma omp parallel for num_threads(max_threads) schedule(dynamic)
+  for (int i = 0; i < max_threads; i++) {// balanced ranges lie about where slice i was read
+    uint64_t begin = STATS::now();
+    PINNED pin(i, max_threads);
+    if (scratch != NULL && part[i+1] > part[i])
+      kx::radix_sort(items+partition[i], items+partition[i+1], RadixTraits<T>(), scratch+part[i], wc_min);
+    else
+      kx::radix_sort(items+partition[i], items+partition[i+1], RadixTraits<T>());
+    STATS::add(stats.sort_ns[omp_get_thread_num()], STATS::now() - begin);
+  }
+  if (scratch != NULL)
+    arena.release(scratch);
+}
+
+inline void parallelSort(TUPLETYPE* tuples, size_t count)
+{
+  parallelRadixSort(tuples, count);
+}
+
+// sort (key, index) tags of the chunk instead of tuples. tuples are left untouched.
+inline void tagSort(const TUPLETYPE* tuples, size_t count, TAGTYPE* tags)
+{
+  #pragma omp parallel for num_threads(max_threads)
+  for (size_t i = 0; i < count; i++) {
+    memcpy(tags[i].key, keyOf(tuples[i]), KEY_SIZE);
+    tags[i].idx = i;
+  }
+  parallelRadixSort(tags, count);
+}
+
+// out[i] = tuples[tags[i].idx]. one sequential write stream per thread.
+inline void gatherTuples(const TUPLETYPE* tuples, const TAGTYPE* tags, size_t count, TUPLETYPE* out)
+{
+  #pragma omp parallel for num_threads(max_threads)
+  for (size_t i = 0; i < count; i++)
+    out[i] = tuples[tags[i].idx];
+}
+
+// same result as gatherTuples into tuples itself, so no second chunk is needed. tags are
+// consumed: keys of at least 4 bytes hold the inverse for the parallel windows, shorter ones
+// leave cycles walked on one thread.
+inline void permuteTuples(TUPLETYPE* tuples, TAGTYPE* tags, size_t count)
+{
+  if (max_threads > 1 && KEY_SIZE >= sizeof(uint32_t))
+    permuteParallel(tuples, count, TAGINDEXES{tags}, TAGKEYS{tags});
+  else
+    permuteSerial(tuples, count, TAGINDEXES{tags});
+}
+
+// chunks are sorted through tags: always with TAG_SORT, and for --stable since tags carry
+// the input position that breaks ties. `tags` must hold a chunk then.
+inline bool sortsTags()
+{
+#ifdef TAG_SORT
+  return true;
+#else
+  return stable_ties;
+#endif
+}
+
+// bytes per tuple needed beside a chunk while it is sorted, through tags or not: tags, and
+// scratch of RADIX_WC or merge indices of presorted runs, whichever is larger(a chunk takes
+// one path or the other).
+inline size_t sortOverhead(bool tagged)
+{
+  size_t item = (tagged ? sizeof(TAGTYPE) : TUPLE_SIZE);
+  return (tagged ? sizeof(TAGTYPE) : 0)
+         + max(radix_wc_min > 0 ? item : 0, PRESORTED_RUNS > 0 ? 2 * sizeof(uint32_t) : 0);
+}
+
+// sort one chunk in place. with tags, radix passes move tags and payloads move once.
+inline void sortChunk(TUPLETYPE* tuples, size_t count)
+{
+  if (sortsTags()) {
+    tagSort(tuples, count, tags);
+    permuteTuples(tuples, tags, count);
+  } else {
+    parallelSort(tuples, count);
+  }
+}
+
+// --unique: keep the first of each run of equal keys in sorted items. returns how many are left.
+template <class T>
+inline size_t uniqueKeys(T* items, size_t count)
+{
+  return unique(items, items + count, [](const T &a, const T &b) {
+    return keyCompare(keyOf(a), keyOf(b)) == 0;
+  }) - items;
+}
+
+#endif
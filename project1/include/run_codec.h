@@ -0,0 +1,274 @@
+#ifndef RUN_CODEC_H
+#define RUN_CODEC_H
+
+#include "external_sort.h"
+
+// spilled runs of COMPRESS_RUNS builds, in blocks of COMPRESS_BLOCK tuples.
+// block of a compressed run:
+//   uint32 key_bytes, uint32 payload_bytes
+//   keys: per tuple, bytes shared with the previous key of the block(1 byte) & the rest of the key
+//   payloads: non-key bytes of every tuple back to back, LZ compressed if that made them smaller
+// tuples of a block are implied by its position in the run (COMPRESS_BLOCK, fewer in the last).
+#define BLOCK_HEADER    (8UL)
+#define PAYLOAD_SIZE    (TUPLE_SIZE - KEY_SIZE)
+#define LZ_HASH_BITS    (14)
+#define LZ_MIN_MATCH    (4UL)
+#define LZ_MAX_OFFSET   (65535UL)
+// largest encoded block: every key whole & payloads stored as is.
+#define BLOCK_BYTES     (BLOCK_HEADER + COMPRESS_BLOCK * (TUPLE_SIZE + 1))
+// what encoding one block takes: the block, its payloads laid out & the LZ hash table.
+#define ENCODE_SLOT     (BLOCK_BYTES + COMPRESS_BLOCK * PAYLOAD_SIZE + (sizeof(uint32_t) << LZ_HASH_BITS))
+
+// LZ4 style sequences: token(literal length << 4 | match length - 4), extra length bytes
+// for nibbles of 15, literals, 2 bytes offset, extra match length bytes.
+// last sequence has literals only. returns 0 if output would not be smaller than cap.
+// table is scratch of 1 << LZ_HASH_BITS entries.
+inline size_t lzCompress(const unsigned char *in, size_t n, unsigned char *out, size_t cap, uint32_t *table)
+{
+  size_t ip = 0, anchor = 0, op = 0;
+
+  fill(table, table + (1 << LZ_HASH_BITS), UINT32_MAX);
+  auto putLength = [&](size_t len) {
+    for (; len >= 255; len -= 255)
+      out[op++] = 255;
+    out[op++] = len;
+  };
+  // token, literals & extra lengths of one sequence; false if it does not fit.
+  auto emit = [&](size_t lit, size_t match, size_t offset) {
+    if (op + 1 + lit / 255 + 1 + lit + 2 + match / 255 + 1 > cap)
+      return false;
+    size_t m = (match ? match - LZ_MIN_MATCH : 0);
+    out[op++] = (min(lit, (size_t)15) << 4) | min(m, (size_t)15);
+    if (lit >= 15)
+      putLength(lit - 15);
+    memcpy(out + op, in + anchor, lit);
+    op += lit;
+    if (match) {
+      out[op++] = offset & 0xFF;
+      out[op++] = offset >> 8;
+      if (m >= 15)
+        putLength(m - 15);
+    }
+    return true;
+  };
+
+  while (ip + LZ_MIN_MATCH <= n) {
+    uint32_t seq;
+    memcpy(&seq, in + ip, sizeof(seq));
+    uint32_t h = (seq * 2654435761U) >> (32 - LZ_HASH_BITS), ref = table[h];
+    table[h] = ip;
+    if (ref == UINT32_MAX || ip - ref > LZ_MAX_OFFSET || memcmp(in + ref, in + ip, LZ_MIN_MATCH) != 0) {
+      ip++;
+      continue;
+    }
+    size_t len = LZ_MIN_MATCH;
+    while (ip + len < n && in[ref + len] == in[ip + len])
+      len++;
+    if (!emit(ip - anchor, len, ip - ref))
+      return 0;
+    ip += len;
+    anchor = ip;
+  }
+  if (!emit(n - anchor, 0, 0) || op >= cap)
+    return 0;
+
+  return op;
+}
+
+inline bool lzDecompress(const unsigned char *in, size_t n, unsigned char *out, size_t out_n)
+{
+  size_t ip = 0, op = 0;
+  auto getLength = [&](size_t len) {
+    unsigned char b = 255;
+    while (b == 255 && ip < n)
+      len += (b = in[ip++]);
+    return len;
+  };
+
+  while (ip < n) {
+    unsigned char token = in[ip++];
+    size_t lit = token >> 4;
+    if (lit == 15)
+      lit = getLength(lit);
+    if (ip + lit > n || op + lit > out_n)
+      return false;
+    memcpy(out + op, in + ip, lit);
+    ip += lit;
+    op += lit;
+    if (ip == n)// last sequence
+      break;
+    if (ip + 2 > n)
+      return false;
+    size_t offset = in[ip] | (in[ip+1] << 8), match = token & 15;
+    ip += 2;
+    if (match == 15)
+      match = getLength(match);
+    match += LZ_MIN_MATCH;
+    if (offset == 0 || offset > op || op + match > out_n)
+      return false;
+    for (size_t i = 0; i < match; i++, op++)// may overlap its own output
+      out[op] = out[op - offset];
+  }
+
+  return op == out_n;
+}
+
+// encode one block of count tuples into slot, an ENCODE_SLOT bytes scratch that starts with
+// the block. returns bytes of the block.
+inline size_t encodeBlock(const TUPLETYPE *tuples, size_t count, unsigned char *slot)
+{
+  unsigned char *out = slot, *payload = slot + BLOCK_BYTES;
+  const size_t payload_size = count * PAYLOAD_SIZE;
+  uint32_t key_bytes = 0, payload_bytes;
+  size_t at = BLOCK_HEADER;
+
+  for (size_t i = 0; i < count; i++) {
+    const unsigned char *key = keyOf(tuples[i]);
+    size_t shared = 0;
+    while (i > 0 && shared < KEY_SIZE && key[shared] == keyOf(tuples[i-1])[shared])
+      shared++;
+    out[at++] = shared;
+    memcpy(out + at, key + shared, KEY_SIZE - shared);
+    at += KEY_SIZE - shared;
+    key_bytes += 1 + KEY_SIZE - shared;
+
+    memcpy(payload + i * PAYLOAD_SIZE, tuples[i].binary, KEY_OFFSET);
+    memcpy(payload + i * PAYLOAD_SIZE + KEY_OFFSET, keyOf(tuples[i]) + KEY_SIZE,
+           TUPLE_SIZE - KEY_OFFSET - KEY_SIZE);
+  }
+
+  uint32_t *table = (uint32_t*)(payload + COMPRESS_BLOCK * PAYLOAD_SIZE);
+  payload_bytes = lzCompress(payload, payload_size, out + at, payload_size, table);
+  if (payload_bytes == 0) {// not compressible: stored as is
+    payload_bytes = payload_size;
+    memcpy(out + at, payload, payload_size);
+  }
+  memcpy(out, &key_bytes, sizeof(key_bytes));
+  memcpy(out + 4, &payload_bytes, sizeof(payload_bytes));
+
+  return at + payload_bytes;
+}
+
+// decode one block of count tuples from nbyte bytes at src. compressed payloads are
+// decoded into the back of tuples itself: tuple i is built aside and stored over bytes
+// no later payload is at, so no scratch is needed.
+inline bool decodeBlock(const unsigned char *src, size_t nbyte, size_t count, TUPLETYPE *tuples)
+{
+  uint32_t key_bytes, payload_bytes;
+
+  if (nbyte < BLOCK_HEADER)
+    return false;
+  memcpy(&key_bytes, src, sizeof(key_bytes));
+  memcpy(&payload_bytes, src + 4, sizeof(payload_bytes));
+  if (BLOCK_HEADER + key_bytes + payload_bytes != nbyte)
+    return false;
+
+  const unsigned char *key = src + BLOCK_HEADER, *key_end = key + key_bytes;
+  const unsigned char *packed = key_end;
+  if (payload_bytes != count * PAYLOAD_SIZE) {
+    unsigned char *payload = tuples[0].binary + count * KEY_SIZE;
+    if (!lzDecompress(packed, payload_bytes, payload, count * PAYLOAD_SIZE))
+      return false;
+    packed = payload;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    TUPLETYPE tuple;
+    unsigned char *dst = tuple.binary + KEY_OFFSET;
+    if (key >= key_end || *key > KEY_SIZE || (i == 0 && *key > 0) || key + 1 + KEY_SIZE - *key > key_end)
+      return false;
+    size_t shared = *key++;
+    if (shared)
+      memcpy(dst, keyOf(tuples[i-1]), shared);
+    memcpy(dst + shared, key, KEY_SIZE - shared);
+    key += KEY_SIZE - shared;
+
+    memcpy(tuple.binary, packed + i * PAYLOAD_SIZE, KEY_OFFSET);
+    memcpy(dst + KEY_SIZE, packed + i * PAYLOAD_SIZE + KEY_OFFSET, TUPLE_SIZE - KEY_OFFSET - KEY_SIZE);
+    tuples[i] = tuple;
+  }
+
+  return key == key_end;
+}
+
+// tuples in block b of a compressed run (the last one may be short).
+inline size_t blockTuples(const FILEINFO &file, size_t b)
+{
+  size_t file_tuples = file.size / TUPLE_SIZE;
+  return min(COMPRESS_BLOCK, file_tuples - b * COMPRESS_BLOCK);
+}
+
+// decode blocks [first, last) of a compressed run, read from the file into src.
+inline void decodeBlocks(const FILEINFO &file, const unsigned char *src, size_t first, size_t last,
+                         TUPLETYPE *tuples)
+{
+  for (size_t b = first; b < last; b++) {
+    size_t nbyte = file.blocks[b+1] - file.blocks[b];
+    if (!decodeBlock(src, nbyte, blockTuples(file, b), tuples)) {
+      printf("error: corrupted block %zu of %s\n", b, file.file_name.c_str());
+      exit(1);
+    }
+    src    += nbyte;
+    tuples += COMPRESS_BLOCK;
+  }
+}
+
+// read & decode block b of a compressed run into out, through packed. both are kept by the
+// caller, so reading more blocks does not allocate again.
+inline void readBlock(const FILEINFO &file, int fd, size_t b, vector<unsigned char> &packed,
+                      vector<TUPLETYPE> &out)
+{
+  packed.resize(file.blocks[b+1] - file.blocks[b]);
+  out.resize(COMPRESS_BLOCK);
+  if (readFromFile(fd, packed.data(), packed.size(), file.blocks[b]) < packed.size()) {
+    printf("error: read %s file\n", file.file_name.c_str());
+    exit(1);
+  }
+  decodeBlocks(file, packed.data(), b, b + 1, out.data());
+}
+
+// blocks encoded at once by writeBlocks: as many slots as 1/COMPRESS_SHARE of the budget
+// holds, at least one and at most 4 per thread.
+inline size_t encodeBatch()
+{
+  return max((size_t)1, min((size_t)4 * max_threads, memory_budget / COMPRESS_SHARE / ENCODE_SLOT));
+}
+
+// bytes writeBlocks takes from the budget while runs are generated.
+inline size_t encodeScratch()
+{
+  return encodeBatch() * ENCODE_SLOT;
+}
+
+// encode count tuples, a batch of blocks at once, & write them back to back to fd. slots of
+// a batch are carved from the arena(encodeScratch), and blocks are moved down behind each
+// other before the write. offset of every block & the end go to blocks. returns bytes written.
+inline size_t writeBlocks(int fd, const TUPLETYPE *tuples, size_t count, vector<size_t> &blocks)
+{
+  const size_t nblocks = (count + COMPRESS_BLOCK - 1) / COMPRESS_BLOCK;
+  const size_t batch   = encodeBatch();
+  unsigned char *slots = (unsigned char*)allocTuples((encodeScratch() + TUPLE_SIZE - 1) / TUPLE_SIZE);
+  vector<size_t> nbyte(batch);
+  size_t offset = 0;
+
+  blocks.assign(1, 0);
+  for (size_t b = 0; b < nblocks; b += batch) {
+    size_t n = min(batch, nblocks - b), out = 0;
+    #pragma omp parallel for num_threads(max_threads) schedule(dynamic)
+    for (size_t i = 0; i < n; i++) {
+      size_t first = (b + i) * COMPRESS_BLOCK;
+      nbyte[i] = encodeBlock(tuples + first, min(COMPRESS_BLOCK, count - first), slots + i * ENCODE_SLOT);
+    }
+    for (size_t i = 0; i < n; i++) {
+      memmove(slots + out, slots + i * ENCODE_SLOT, nbyte[i]);
+      out += nbyte[i];
+      blocks.push_back(offset + out);
+    }
+    offset += writeToFile(fd, slots, out, offset);
+  }
+  freeTuples((TUPLETYPE*)slots);
+
+  return offset;
+}
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef SELECT_H
+#define SELECT_H
+
+#include "external_sort.h"
+#include "parallel_sort.h"
+#include "stats.h"
+
+// -k / --from / --to: only the smallest top_tuples tuples with keys in [range_from, range_to)
+// are sorted & written, the rest of the input is read once and dropped. input is read in
+// double buffered windows, every thread drops tuples of its slice in place and survivors are
+// appended in input order(so --stable holds). with -k, survivors are sorted & cut back to
+// top_tuples whenever they double, and the last one kept bounds the range from then on.
+
+// hex digits, most significant first. missing bytes are 0: a prefix names the smallest key
+// starting with it.
+inline bool parseKey(const char *hex, MERGEKEY &key)
+{
+  unsigned char bytes[KEY_SIZE] = {0};
+  size_t len = strlen(hex);
+  if (len == 0 || len > 2 * KEY_SIZE || strspn(hex, "0123456789abcdefABCDEF") != len)
+    return false;
+  for (size_t i = 0; i < len; i++) {
+    int digit = (isdigit(hex[i]) ? hex[i] - '0' : toupper(hex[i]) - 'A' + 10);
+    bytes[i / 2] |= digit << (i % 2 ? 0 : 4);
+  }
+  key.load(bytes);
+  return true;
+}
+
+inline bool selects() { return top_tuples > 0 || select_range; }
+
+// sort survivors and keep what the output starts with. returns how many are left.
+inline size_t cutSelected(TUPLETYPE *tuples, size_t count)
+{
+  sortChunk(tuples, count);
+  if (unique_keys)
+    count = uniqueKeys(tuples, count);
+  return (top_tuples > 0 ? min(count, top_tuples) : count);
+}
+
+// reads the whole input and leaves survivors, not sorted yet, in `tuples`(and room for
+// their tags in `tags`). returns how many there are.
+inline size_t selectTuples(int fd, bool stream)
+{
+  const size_t per_tuple = TUPLE_SIZE + sortOverhead(sortsTags());
+  const size_t window    = max((size_t)1, min(buffer_size, memory_budget / 8) / TUPLE_SIZE);
+  size_t cap             = (memory_budget - min(memory_budget, 2 * window * TUPLE_SIZE)) / per_tuple;
+  if (sortsTags())
+    cap = min(cap, MAX_TAG_TUPLES);
+  if (cap < window + top_tuples) {
+    printf("error: memory budget too small to keep %zu tuples\n", top_tuples);
+    exit(1);
+  }
+
+  TUPLETYPE *buf[2] = {allocTuples(window), allocTuples(window)};
+  size_t count[2];
+  tuples = allocTuples(cap);
+  if (sortsTags())
+    tags = new TAGTYPE[cap];
+  auto readWindow = [fd, stream, window](size_t w, TUPLETYPE *into) -> size_t {
+    if (stream)// in order; short only at EOF
+      return readFromFile(fd, into, window * TUPLE_SIZE, 0) / TUPLE_SIZE;
+    size_t n = min(window, total_tuples - min(total_tuples, w * window));
+    parallelRead(fd, into, n, w * window * TUPLE_SIZE);
+    return n;
+  };
+
+  // while a window is filtered, the other one is read.
+  MERGEKEY upper = range_to;
+  size_t kept = 0;
+  vector<size_t> at(max_threads + 1);
+  count[0] = readWindow(0, buf[0]);
+  for (size_t w = 0; count[w % 2] > 0; w++) {
+    const int cur = w % 2, other = (w + 1) % 2;
+    future<void> io = async(launch::async, [&readWindow, &buf, &count, w, other]() {
+      count[other] = readWindow(w + 1, buf[other]);
+    });
+    TUPLETYPE *in = buf[cur];
+    const size_t n = count[cur];
+    if (stream)
+      total_tuples += n;
+
+    #pragma omp parallel for num_threads(max_threads)
+    for (int t = 0; t < max_threads; t++) {
+      PINNED pin(t, max_threads);
+      size_t out = n * t / max_threads;
+      for (size_t i = out; i < n * (t+1) / max_threads; i++) {
+        MERGEKEY key;
+        key.load(in[i]);
+        if (!(key < range_from) && key < upper)
+          in[out++] = in[i];
+      }
+      at[t+1] = out - n * t / max_threads;
+    }
+    at[0] = kept;
+    for (int t = 0; t < max_threads; t++)
+      at[t+1] += at[t];
+    if (at[max_threads] > cap) {
+      printf("error: selected tuples do not fit in memory budget\n");
+      exit(1);
+    }
+    #pragma omp parallel for num_threads(max_threads)
+    for (int t = 0; t < max_threads; t++)
+      memcpy(tuples + at[t], in + n * t / max_threads, (at[t+1] - at[t]) * TUPLE_SIZE);
+    kept = at[max_threads];
+
+    // next window must fit as a whole.
+    if (top_tuples > 0 && kept > top_tuples && (kept >= 2 * top_tuples || kept + window > cap)) {
+      kept = cutSelected(tuples, kept);
+      if (kept == top_tuples)// a later key equal to the last one kept comes after it
+        upper.load(tuples[kept-1]);
+    }
+    uint64_t wait = STATS::now();
+    io.get();
+    stats.run_wait_ns += STATS::now() - wait;
+  }
+  freeTuples(buf[0]);
+  freeTuples(buf[1]);
+
+  return kept;
+}
+
+#endif
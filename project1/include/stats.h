@@ -0,0 +1,140 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "external_sort.h"
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <sys/resource.h>
+
+// how parallelRadixSort() put a chunk(or its tags) in order.
+enum SORTPATH { RADIXED, PRESORTED, REVERSED, MERGED, SORT_PATHS };
+
+// counters kept on every run, cheap enough to leave on: a clock read per phase, buffer
+// or sorted range, and a relaxed add per read & write. ./run -s file (EXTSORT_STATS)
+// writes them as JSON, "-" to stderr. wait times tell I/O bound from CPU bound runs.
+class STATS {
+  public:
+    class MERGESTAT {
+      public:
+        int runs;
+        uint64_t bytes, ns;
+    };
+
+    string path;                               // where JSON goes, none if empty
+    vector<pair<string, uint64_t> > phases;    // wall time of each phase in order
+    vector<uint64_t> sort_ns;                  // per thread: radix sort of its key ranges
+    uint64_t partition_ns;                     // splitting chunks into key ranges
+    uint64_t run_wait_ns;                      // chunk sorted(or window selected), other one still spilled & read
+    uint64_t read_wait_ns;                     // merge threads blocked on reads of runs
+    uint64_t write_wait_ns;                    // merge & gather threads blocked on writes
+    uint64_t fault_ns;                         // faulting tuple buffers in, see arena.h
+    uint64_t sort_paths[SORT_PATHS];           // sorted chunks by SORTPATH
+    vector<MERGESTAT> merges;                  // every merge pass, final one last
+
+    STATS() : partition_ns(0), run_wait_ns(0), read_wait_ns(0), write_wait_ns(0), fault_ns(0), sort_paths(),
+              fd_read(DIRECT_FDS, 0), fd_written(DIRECT_FDS, 0) {};
+
+    static uint64_t now()
+    {
+      return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    static void add(uint64_t &counter, uint64_t n) { __atomic_fetch_add(&counter, n, __ATOMIC_RELAXED); }
+
+    void phase(const string &name, uint64_t start) { phases.push_back(make_pair(name, now() - start)); }
+    void open(int fd, const string &name);
+    void close(int fd);
+    void read(int fd, size_t nbyte) { if (fd >= 0 && fd < (int)DIRECT_FDS) add(fd_read[fd], nbyte); }
+    void wrote(int fd, size_t nbyte) { if (fd >= 0 && fd < (int)DIRECT_FDS) add(fd_written[fd], nbyte); }
+    void write();
+
+  private:
+    vector<uint64_t> fd_read, fd_written;      // bytes through each open fd
+    map<int, string> fd_name;
+    map<string, pair<uint64_t, uint64_t> > files;// read & written bytes by file name
+    mutex lock;
+};
+
+STATS stats;
+
+inline void STATS::open(int fd, const string &name)
+{
+  if (fd < 0 || fd >= (int)DIRECT_FDS)
+    return;
+  lock_guard<mutex> guard(lock);
+  fd_name[fd] = name;
+  fd_read[fd] = fd_written[fd] = 0;
+}
+
+inline void STATS::close(int fd)
+{
+  if (fd < 0 || fd >= (int)DIRECT_FDS)
+    return;
+  lock_guard<mutex> guard(lock);
+  auto it = fd_name.find(fd);
+  if (it == fd_name.end())
+    return;
+  files[it->second].first  += fd_read[fd];
+  files[it->second].second += fd_written[fd];
+  fd_name.erase(it);
+}
+
+inline void STATS::write()
+{
+  if (path.empty())
+    return;
+  FILE *fp = (path == "-" ? stderr : fopen(path.c_str(), "w"));
+  if (fp == NULL) {
+    printf("error: open %s file\n", path.c_str());
+    return;
+  }
+  for (auto it = fd_name.begin(); it != fd_name.end(); )// still open
+    close((it++)->first);
+
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  auto ms = [](uint64_t ns) { return ns / 1e6; };
+  auto tv = [](const timeval &t) { return t.tv_sec * 1e3 + t.tv_usec / 1e3; };
+  auto quote = [](const string &str) {
+    string out;
+    for (size_t i = 0; i < str.size(); i++) {
+      if (str[i] == '"' || str[i] == '\\')
+        out += '\\';
+      if ((unsigned char)str[i] >= 0x20)
+        out += str[i];
+    }
+    return out;
+  };
+
+  fprintf(fp, "{\n  \"threads\": %d,\n  \"memory_budget\": %zu,\n  \"tuples\": %zu,\n",
+          max_threads, memory_budget, total_tuples);
+  fprintf(fp, "  \"phases_ms\": {");
+  for (size_t i = 0; i < phases.size(); i++)
+    fprintf(fp, "%s\n    \"%s\": %.3f", (i ? "," : ""), phases[i].first.c_str(), ms(phases[i].second));
+  fprintf(fp, "\n  },\n  \"cpu_ms\": {\"user\": %.3f, \"system\": %.3f},\n", tv(usage.ru_utime), tv(usage.ru_stime));
+  fprintf(fp, "  \"wait_ms\": {\"run_io\": %.3f, \"merge_read\": %.3f, \"write\": %.3f},\n",
+          ms(run_wait_ns), ms(read_wait_ns), ms(write_wait_ns));
+  fprintf(fp, "  \"prefault_ms\": %.3f,\n", ms(fault_ns));
+  fprintf(fp, "  \"sort_paths\": {\"radix\": %llu, \"presorted\": %llu, \"reversed\": %llu, \"merged\": %llu},\n",
+          (unsigned long long)sort_paths[RADIXED], (unsigned long long)sort_paths[PRESORTED],
+          (unsigned long long)sort_paths[REVERSED], (unsigned long long)sort_paths[MERGED]);
+  fprintf(fp, "  \"partition_ms\": %.3f,\n  \"sort_thread_ms\": [", ms(partition_ns));
+  for (size_t i = 0; i < sort_ns.size(); i++)
+    fprintf(fp, "%s%.3f", (i ? ", " : ""), ms(sort_ns[i]));
+  fprintf(fp, "],\n  \"merges\": [");
+  for (size_t i = 0; i < merges.size(); i++)
+    fprintf(fp, "%s\n    {\"runs\": %d, \"bytes\": %llu, \"ms\": %.3f, \"mb_per_s\": %.1f}", (i ? "," : ""),
+            merges[i].runs, (unsigned long long)merges[i].bytes, ms(merges[i].ns),
+            merges[i].ns ? merges[i].bytes * 1e3 / merges[i].ns : 0.0);
+  fprintf(fp, "%s],\n  \"files\": [", (merges.empty() ? "" : "\n  "));
+  size_t i = 0;
+  for (auto it = files.begin(); it != files.end(); it++, i++)
+    fprintf(fp, "%s\n    {\"name\": \"%s\", \"read\": %llu, \"written\": %llu}", (i ? "," : ""),
+            quote(it->first).c_str(), (unsigned long long)it->second.first, (unsigned long long)it->second.second);
+  fprintf(fp, "%s]\n}\n", (files.empty() ? "" : "\n  "));
+
+  if (fp != stderr)
+    fclose(fp);
+}
+
+#endif
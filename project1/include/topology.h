@@ -0,0 +1,136 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include "external_sort.h"
+#include <dirent.h>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+
+// NUMA: thread t of a team of `threads` works on slice t of a buffer(read, histogram, radix
+// partition, prefault), so slices are spread over nodes in order, in proportion to the cores
+// each node lends us. a thread is pinned to the cores of its slice's node, and the arena binds
+// the pages of the slice there before faulting them in. nodes come from sysfs, no libnuma.
+// one node(or no sysfs) leaves every thread on every core and pages where they fault.
+// NUMA_NODES splits the cores of a machine with fewer nodes into that many, on the memory of
+// the first node, so pinning can be tested on a single node.
+class TOPOLOGY {
+  public:
+    int nodes;              // nodes with cores we may run on
+    vector<int> cpu_node;   // node index(0..nodes-1) of each core we may run on, node by node
+    vector<int> node_id;    // kernel id of each node
+    vector<cpu_set_t> node_cpus;
+
+    TOPOLOGY() : nodes(0) {};
+
+    void probe();
+    int nodeOf(int t, int threads) const
+    {
+      return (nodes < 2 ? 0 : cpu_node[(size_t)t * cpu_node.size() / max(1, threads)]);
+    }
+};
+
+TOPOLOGY topology;
+
+inline void TOPOLOGY::probe()
+{
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    return;
+  DIR *dir = opendir("/sys/devices/system/node");
+  vector<int> ids;
+  for (struct dirent *entry; dir != NULL && (entry = readdir(dir)) != NULL; )
+    if (strncmp(entry->d_name, "node", 4) == 0 && isdigit(entry->d_name[4]))
+      ids.push_back(atoi(entry->d_name + 4));
+  if (dir != NULL)
+    closedir(dir);
+  sort(ids.begin(), ids.end());
+
+  for (size_t i = 0; i < ids.size(); i++) {
+    string path = "/sys/devices/system/node/node" + to_string(ids[i]) + "/cpulist";
+    FILE *fp = fopen(path.c_str(), "r");
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    int lo, hi, n;
+    while (fp != NULL && (n = fscanf(fp, "%d-%d", &lo, &hi)) >= 1) {// "0-7,16-23"
+      for (int c = lo; c <= (n == 2 ? hi : lo); c++)
+        if (c < CPU_SETSIZE && CPU_ISSET(c, &allowed))
+          CPU_SET(c, &cpus);
+      if (fgetc(fp) != ',')
+        break;
+    }
+    if (fp != NULL)
+      fclose(fp);
+    if (CPU_COUNT(&cpus) == 0)// memory only, or none of its cores are ours
+      continue;
+    for (int c = 0; c < CPU_COUNT(&cpus); c++)
+      cpu_node.push_back(nodes);
+    node_id.push_back(ids[i]);
+    node_cpus.push_back(cpus);
+    nodes++;
+  }
+#ifdef NUMA_NODES
+  if (nodes < NUMA_NODES) {
+    const int cores = CPU_COUNT(&allowed), id = (node_id.empty() ? 0 : node_id[0]);
+    nodes = min(NUMA_NODES, cores);
+    cpu_node.clear();
+    node_id.assign(nodes, id);
+    node_cpus.assign(nodes, cpu_set_t());
+    for (int n = 0; n < nodes; n++)
+      CPU_ZERO(&node_cpus[n]);
+    for (int c = 0, i = 0; c < CPU_SETSIZE && i < cores; c++) {
+      if (!CPU_ISSET(c, &allowed))
+        continue;
+      cpu_node.push_back(i++ * nodes / cores);
+      CPU_SET(c, &node_cpus[cpu_node.back()]);
+    }
+  }
+#endif
+#ifdef VERBOSE
+  printf("numa: %d nodes, %zu cores\n", nodes, cpu_node.size());
+#endif
+}
+
+// runs the calling thread on the cores of the node slice t belongs to, while it works on the
+// slice: the mask it had is put back when the slice is done, so OpenMP pool threads(and the
+// master, thread 0 of every team) do not carry a node into later async or merge threads.
+// no-op unless NUMA found more than one node.
+class PINNED {
+  public:
+    PINNED(int t, int threads) : pinned(false)
+    {
+#ifdef NUMA
+      if (topology.nodes < 2 || sched_getaffinity(0, sizeof(saved), &saved) != 0)
+        return;
+      pinned = (sched_setaffinity(0, sizeof(cpu_set_t), &topology.node_cpus[topology.nodeOf(t, threads)]) == 0);
+#endif
+    }
+    ~PINNED()
+    {
+#ifdef NUMA
+      if (pinned)
+        sched_setaffinity(0, sizeof(saved), &saved);
+#endif
+    }
+
+  private:
+    bool pinned;
+    cpu_set_t saved;
+};
+
+// pages of [addr, addr + nbyte) go to the node of slice t when they are faulted in. the arena
+// places slices of the range it faults in at a time, not of the buffers in it: a buffer
+// carved from the unfaulted end matches slices of its own readers & sorters(but for page
+// rounding), a buffer in pages faulted for an earlier one keeps that one's placement.
+inline void placeSlice(void *addr, size_t nbyte, int t, int threads)
+{
+#ifdef NUMA
+  if (topology.nodes < 2 || nbyte == 0)
+    return;
+  const int id = topology.node_id[topology.nodeOf(t, threads)];
+  vector<unsigned long> mask(id / (8 * sizeof(unsigned long)) + 1, 0);
+  mask[id / (8 * sizeof(unsigned long))] = 1UL << (id % (8 * sizeof(unsigned long)));
+  syscall(SYS_mbind, addr, nbyte, MPOL_PREFERRED, mask.data(), mask.size() * 8 * sizeof(unsigned long) + 1, 0);
+#endif
+}
+
+#endif
@@ -0,0 +1,249 @@
+#ifndef URING_H
+#define URING_H
+
+#include "external_sort.h"
+#include "stats.h"
+#include <cerrno>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+// minimal io_uring over raw syscalls, owned by one merge thread.
+// reads & writes are queued and go to the kernel in one batch on the next submit() or wait().
+class URING {
+  public:
+    URING() : ring_fd(-1), queued(0) {};
+    ~URING() { exit(); }
+
+    bool init(unsigned entries);
+    bool registerBuffers(const vector<iovec> &bufs);
+    int read(int fd, void *buf, size_t nbyte, size_t offset)
+    {
+      return prepare(IORING_OP_READ, fd, (char*)buf, nbyte, offset);
+    }
+    int write(int fd, const void *buf, size_t nbyte, size_t offset)
+    {
+      return prepare(IORING_OP_WRITE, fd, (char*)buf, nbyte, offset);
+    }
+    void submit();
+    size_t wait(int slot);
+    void exit();
+
+  private:
+    class SLOT {
+      public:
+        bool busy, done;
+        int op, fd, res;
+        char *buf;
+        size_t nbyte, offset;
+        size_t extra;      // bytes written through the page cache at prepare()
+
+        SLOT() : busy(false), done(false) {};
+    };
+
+    int ring_fd;
+    unsigned queued;       // prepared sqes not handed to the kernel yet
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_sqe *sqes;
+    io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    vector<iovec> fixed;   // registered buffers, READ_FIXED/WRITE_FIXED inside them
+    vector<SLOT> slots;    // one per request in flight, user_data of its sqe
+
+    int prepare(int op, int fd, char *buf, size_t nbyte, size_t offset);
+    int enter(unsigned to_submit, unsigned min_complete);
+    void reap();
+};
+
+inline bool URING::init(unsigned entries)
+{
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring_fd < 0) {
+    ring_fd = -1;
+    return false;
+  }
+
+  sq_len   = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_len   = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  sqes_len = params.sq_entries * sizeof(io_uring_sqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    sq_len = cq_len = max(sq_len, cq_len);
+
+  sq_ptr = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  cq_ptr = (params.features & IORING_FEAT_SINGLE_MMAP) ? sq_ptr :
+           mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+  sqes   = (io_uring_sqe*)mmap(NULL, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                               ring_fd, IORING_OFF_SQES);
+  if (sq_ptr == MAP_FAILED || cq_ptr == MAP_FAILED || sqes == MAP_FAILED) {
+    if (sq_ptr != MAP_FAILED)
+      munmap(sq_ptr, sq_len);
+    if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+      munmap(cq_ptr, cq_len);
+    if (sqes != MAP_FAILED)
+      munmap(sqes, sqes_len);
+    ::close(ring_fd);
+    ring_fd = -1;
+    return false;
+  }
+
+  sq_tail  = (unsigned*)((char*)sq_ptr + params.sq_off.tail);
+  sq_mask  = (unsigned*)((char*)sq_ptr + params.sq_off.ring_mask);
+  sq_array = (unsigned*)((char*)sq_ptr + params.sq_off.array);
+  cq_head  = (unsigned*)((char*)cq_ptr + params.cq_off.head);
+  cq_tail  = (unsigned*)((char*)cq_ptr + params.cq_off.tail);
+  cq_mask  = (unsigned*)((char*)cq_ptr + params.cq_off.ring_mask);
+  cqes     = (io_uring_cqe*)((char*)cq_ptr + params.cq_off.cqes);
+  // never more requests in flight than sqes, so neither ring can overflow.
+  slots.assign(params.sq_entries, SLOT());
+  queued = 0;
+
+  return true;
+}
+
+inline bool URING::registerBuffers(const vector<iovec> &bufs)
+{
+  // pinned pages count against RLIMIT_MEMLOCK. plain READ/WRITE still work if it fails.
+  if (ring_fd == -1 || bufs.empty() ||
+      syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, bufs.data(), bufs.size()) < 0)
+    return false;
+  fixed = bufs;
+  return true;
+}
+
+inline int URING::prepare(int op, int fd, char *buf, size_t nbyte, size_t offset)
+{
+  // O_DIRECT: partial blocks at both ends of a write go through the page cache right away,
+  // whole blocks to the twin. reads arrive block aligned from RUNREADER.
+  int sqe_fd = fd;
+  size_t extra = 0;
+  if (directFd(fd) != -1 && (uintptr_t)buf % DIRECT_ALIGN == offset % DIRECT_ALIGN) {
+    if (op == IORING_OP_WRITE) {
+      size_t head = min(nbyte, (DIRECT_ALIGN - offset % DIRECT_ALIGN) % DIRECT_ALIGN);
+      size_t tail = (nbyte - head) % DIRECT_ALIGN;
+      extra  = writeToFile(fd, buf, head, offset);
+      extra += writeToFile(fd, buf + nbyte - tail, tail, offset + nbyte - tail);
+      buf    += head;
+      offset += head;
+      nbyte  -= head + tail;
+      sqe_fd  = directFd(fd);
+    } else if (offset % DIRECT_ALIGN == 0 && nbyte % DIRECT_ALIGN == 0) {
+      sqe_fd  = directFd(fd);
+    }
+  }
+
+  int slot = 0;
+  while (slots[slot].busy)
+    slot++;
+  SLOT &s = slots[slot];
+  s.busy   = true;
+  s.done   = false;
+  s.op     = op;
+  s.fd     = fd;
+  s.buf    = buf;
+  s.nbyte  = nbyte;
+  s.offset = offset;
+  s.extra  = extra;
+
+  unsigned tail = *sq_tail, idx = tail & *sq_mask;
+  io_uring_sqe *sqe = &sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode    = op;
+  sqe->fd        = sqe_fd;
+  sqe->addr      = (uint64_t)buf;
+  sqe->len       = nbyte;
+  sqe->off       = offset;
+  sqe->user_data = slot;
+  for (size_t i = 0; i < fixed.size(); i++) {
+    char *base = (char*)fixed[i].iov_base;
+    if (buf >= base && buf + nbyte <= base + fixed[i].iov_len) {
+      sqe->opcode    = (op == IORING_OP_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED);
+      sqe->buf_index = i;
+      break;
+    }
+  }
+  sq_array[idx] = idx;
+  __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+  queued++;
+
+  return slot;
+}
+
+inline int URING::enter(unsigned to_submit, unsigned min_complete)
+{
+  int ret;
+  do {
+    ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                  min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while (ret < 0 && errno == EINTR);
+  if (ret < 0) {
+    printf("error: io_uring_enter\n");
+    ::exit(1);
+  }
+  return ret;
+}
+
+inline void URING::submit()
+{
+  while (queued)
+    queued -= enter(queued, 0);
+}
+
+inline void URING::reap()
+{
+  unsigned head = *cq_head, tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+  for (; head != tail; head++) {
+    io_uring_cqe *cqe = &cqes[head & *cq_mask];
+    slots[cqe->user_data].res  = cqe->res;
+    slots[cqe->user_data].done = true;
+  }
+  __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+inline size_t URING::wait(int slot)
+{
+  SLOT &s = slots[slot];
+
+  for (reap(); !s.done; reap())
+    queued -= enter(queued, 1);
+  s.busy = false;
+
+  // failed (e.g. opcode unknown to the kernel) or short: finish with pread/pwrite.
+  size_t done = max(s.res, 0);
+  if (s.op == IORING_OP_READ)
+    stats.read(s.fd, done);
+  else
+    stats.wrote(s.fd, done);
+  if (done < s.nbyte) {
+    if (s.op == IORING_OP_READ)
+      done += readFromFile(s.fd, s.buf + done, s.nbyte - done, s.offset + done);
+    else
+      done += writeToFile(s.fd, s.buf + done, s.nbyte - done, s.offset + done);
+  }
+
+  return done + s.extra;
+}
+
+inline void URING::exit()
+{
+  if (ring_fd == -1)
+    return;
+  for (size_t i = 0; i < slots.size(); i++) {
+    if (slots[i].busy)
+      wait(i);
+  }
+  munmap(sqes, sqes_len);
+  if (cq_ptr != sq_ptr)
+    munmap(cq_ptr, cq_len);
+  munmap(sq_ptr, sq_len);
+  ::close(ring_fd);// also unregisters buffers
+  ring_fd = -1;
+  fixed.clear();
+}
+
+#endif
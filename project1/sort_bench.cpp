@@ -0,0 +1,165 @@
+#include "external_sort.h"
+#include "kernels.h"
+#include "parallel_sort.h"
+#include <chrono>
+#include <climits>
+#include <iostream>
+#include <random>
+using namespace std::chrono;
+
+// compare parallelSort() on whole tuples(in place, and out of place through write combining
+// buffers as with RADIX_WC) against TAG_SORT (tag sort + gather into a second buffer,
+// tag sort + in-place permutation) on the same random chunk, then parallelSort() on that
+// chunk sorted and reversed, which it finds out instead of radix sorting.
+// before that, key kernels on one thread against their scalar versions: compare of every
+// neighbour pair, and histograms of the first key byte of random & of sorted tuples.
+// usage: ./sort_bench [tuples(default 10000000 = 1GB)] [repeat(default 3)] [threads(default MAX_THREADS)]
+
+static bool isSorted(const TUPLETYPE *tuples, size_t count)
+{
+  bool sorted = true;
+  #pragma omp parallel for num_threads(max_threads) reduction(&&:sorted)
+  for (size_t i = 1; i < count; i++)
+    sorted = sorted && !(tuples[i] < tuples[i-1]);
+  return sorted;
+}
+
+static void report(const char *name, vector<long long> &ms, size_t count, bool sorted)
+{
+  sort(ms.begin(), ms.end());
+  printf("%-22s best %6lldms  median %6lldms  %8.1f MB/s  %s\n", name, ms[0], ms[ms.size()/2],
+         count * TUPLE_SIZE / 1000.0 / max(ms[0], 1LL), sorted ? "sorted" : "NOT SORTED");
+}
+
+// best time of fn over repeat runs, and what it returned(the same for every kernel).
+template <class F>
+static void kernel(const char *name, int repeat, size_t count, F fn)
+{
+  long long best = LLONG_MAX;
+  size_t result = 0;
+  for (int r = 0; r < repeat; r++) {
+    auto start = high_resolution_clock::now();
+    result = fn();
+    best = min(best, (long long)duration_cast<microseconds>(high_resolution_clock::now() - start).count());
+  }
+  printf("%-22s best %8.1fms  %6.2f ns/tuple  (%zu)\n", name, best / 1000.0, best * 1000.0 / max(count, (size_t)1),
+         result);
+}
+
+static void benchKernels(const TUPLETYPE *tuples, size_t count, int repeat, const char *what)
+{
+  printf("%s:\n", what);
+  kernel("  memcmp", repeat, count, [=]() {
+    size_t less = 0;
+    for (size_t i = 1; i < count; i++)
+      less += memcmp(keyOf(tuples[i-1]), keyOf(tuples[i]), KEY_SIZE) < 0;
+    return less;
+  });
+  kernel("  keyCompare", repeat, count, [=]() {
+    size_t less = 0;
+    for (size_t i = 1; i < count; i++)
+      less += keyCompare(keyOf(tuples[i-1]), keyOf(tuples[i])) < 0;
+    return less;
+  });
+  const char *names[] = {"  histogram plain", "  histogram 4 tables", "  histogram avx2"};
+  for (int k = PLAIN; k <= AVX2; k++) {
+    if (k == AVX2 && !__builtin_cpu_supports("avx2"))
+      continue;
+    kernel(names[k], repeat, count, [=]() {
+      size_t hist[256] = {0};
+      countBytes(tuples, TUPLE_SIZE, KEY_OFFSET, count, hist, (HISTOGRAM)k);
+      return hist[0];
+    });
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  size_t count = argc > 1 ? strtoull(argv[1], NULL, 10) : 10000000UL;
+  int repeat   = argc > 2 ? atoi(argv[2]) : 3;
+  max_threads  = argc > 3 ? max(1, atoi(argv[3])) : MAX_THREADS;
+  TUPLETYPE *input = new TUPLETYPE[count], *work = new TUPLETYPE[count], *out = new TUPLETYPE[count];
+  tags = new TAGTYPE[count];
+
+  // random binary keys & payloads, filled in parallel.
+  #pragma omp parallel num_threads(max_threads)
+  {
+    mt19937_64 gen(omp_get_thread_num() + 1);
+    #pragma omp for
+    for (size_t i = 0; i < count; i++)
+      for (size_t j = 0; j < TUPLE_SIZE; j += 4) {
+        uint32_t r = gen();
+        memcpy(input[i].binary + j, &r, min((size_t)4, TUPLE_SIZE - j));
+      }
+  }
+  printf("%zu tuples (%zu MB), %d threads, %d repeats\n", count, count * TUPLE_SIZE / 1000000, max_threads, repeat);
+  const char *kernels[] = {"plain", "4 tables", "avx2"};
+  printf("radix histogram kernel: %s\n", kernels[histogramKernel()]);
+  benchKernels(input, count, repeat, "random keys");
+  memcpy(work, input, count * TUPLE_SIZE);
+  parallelSort(work, count);
+  benchKernels(work, count, repeat, "sorted keys");
+
+  vector<long long> sort_ms, wc_ms, gather_ms, permute_ms;
+  bool sort_ok = true, wc_ok = true, gather_ok = true, permute_ok = true;
+  const size_t wc_min = radix_wc_min;
+  for (int r = 0; r < repeat; r++) {
+    memcpy(work, input, count * TUPLE_SIZE);
+    radix_wc_min = 0;
+    auto start = high_resolution_clock::now();
+    parallelSort(work, count);
+    sort_ms.push_back(duration_cast<milliseconds>(high_resolution_clock::now() - start).count());
+    sort_ok = sort_ok && isSorted(work, count);
+
+    memcpy(work, input, count * TUPLE_SIZE);
+    radix_wc_min = RADIX_WC_MIN;
+    start = high_resolution_clock::now();
+    parallelSort(work, count);
+    wc_ms.push_back(duration_cast<milliseconds>(high_resolution_clock::now() - start).count());
+    wc_ok = wc_ok && isSorted(work, count);
+    radix_wc_min = wc_min;
+
+    memcpy(work, input, count * TUPLE_SIZE);
+    start = high_resolution_clock::now();
+    tagSort(work, count, tags);
+    gatherTuples(work, tags, count, out);
+    gather_ms.push_back(duration_cast<milliseconds>(high_resolution_clock::now() - start).count());
+    gather_ok = gather_ok && isSorted(out, count);
+
+    memcpy(work, input, count * TUPLE_SIZE);
+    start = high_resolution_clock::now();
+    tagSort(work, count, tags);
+    permuteTuples(work, tags, count);
+    permute_ms.push_back(duration_cast<milliseconds>(high_resolution_clock::now() - start).count());
+    permute_ok = permute_ok && isSorted(work, count);
+  }
+
+  // work holds the sorted chunk now.
+  vector<long long> sorted_ms, reversed_ms;
+  bool sorted_ok = true, reversed_ok = true;
+  for (int r = 0; r < repeat; r++) {
+    auto start = high_resolution_clock::now();
+    parallelSort(work, count);
+    sorted_ms.push_back(duration_cast<milliseconds>(high_resolution_clock::now() - start).count());
+    sorted_ok = sorted_ok && isSorted(work, count);
+
+    reverse(work, work + count);
+    start = high_resolution_clock::now();
+    parallelSort(work, count);
+    reversed_ms.push_back(duration_cast<milliseconds>(high_resolution_clock::now() - start).count());
+    reversed_ok = reversed_ok && isSorted(work, count);
+  }
+
+  report("parallelSort", sort_ms, count, sort_ok);
+  report("parallelSort + wc", wc_ms, count, wc_ok);
+  report("tagSort + gather", gather_ms, count, gather_ok);
+  report("tagSort + permute", permute_ms, count, permute_ok);
+  report("parallelSort sorted", sorted_ms, count, sorted_ok);
+  report("parallelSort reversed", reversed_ms, count, reversed_ok);
+
+  delete[] input;
+  delete[] work;
+  delete[] out;
+  delete[] tags;
+  return !(sort_ok && wc_ok && gather_ok && permute_ok && sorted_ok && reversed_ok);
+}
@@ -1,90 +1,119 @@
 #include "external_sort.h"
-#include "kxsort.h"
+#include "arena.h"
+#include "checkpoint.h"
+#include "parallel_sort.h"
+#include "run_codec.h"
+#include "select.h"
+#include "stats.h"
+#include "topology.h"
+#include "uring.h"
 
 int main(int argc, char* argv[])
 {
-  if (argc < 3) {
-    printf("usage: ./run InputFile OutputFile\n");
-    exit(0);
+  int arg = configure(argc, argv);
+#ifdef NUMA
+  topology.probe();
+#endif
+  if (argc - arg < 2) {
+    printf("usage: ./run [-a] [-t threads] [-m memory] [-c chunk] [-b read_buf] [-w write_buf] [-s stats.json] "
+           "[--stable] [--unique] [-k tuples] [--from key] [--to key] InputFile OutputFile\n");
+    exit(1);
+  }
+
+  // "-" writes sorted tuples to stdout. messages go to stderr then, so they stay out of the data.
+  const uint64_t start = STATS::now();
+  int stdout_fd = -1;
+  if (strcmp(argv[arg+1], "-") == 0) {
+    stdout_fd = dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    stats.open(stdout_fd, "stdout");
   }
 
-  // open input file.
-  int input_fd = open(argv[1], O_RDONLY);
+  // open input file. "-" reads stdin.
+  int input_fd = (strcmp(argv[arg], "-") == 0 ? STDIN_FILENO : openFile(argv[arg], O_RDONLY));
   if (input_fd == -1) {
     printf("error: open input file\n");
-    exit(0);
+    exit(1);
   }
+  if (input_fd == STDIN_FILENO)
+    stats.open(input_fd, "stdin");
 
-  // get size of input file.
-  const size_t file_size = lseek(input_fd, 0, SEEK_END);
-  total_file       = (file_size / FILE_THRESHOLD)
-                   + (file_size % FILE_THRESHOLD == 0 ? 0 : 1);
+  // get size of input file. a pipe has none: it is read chunk by chunk until EOF.
+  const bool stream = !seekable(input_fd);
+  size_t file_size = (stream ? 0 : lseek(input_fd, 0, SEEK_END));
+  total_file       = max((size_t)1, (file_size / file_threshold)
+                   + (file_size % file_threshold == 0 ? 0 : 1));
   total_tuples     = (file_size / TUPLE_SIZE);
-  chunk_per_file   = (file_size / total_file);
-  chunk_per_thread = chunk_per_file / MAX_THREADS;
-  int tmp_fd[total_file - 1];
-  future<size_t> tmp_write[total_file - 1];
-  TUPLETYPE *read_buf[total_file - 1][2];
+  const bool inmemory = (total_file <= 2 && !stream && sortsInMemory(total_tuples));
+  if (!inmemory)// RUN_BUFFERS chunks are alive while runs are generated, so runs may get smaller.
+    total_file     = max({(size_t)total_file, (size_t)2, (total_tuples + runTuples() - 1) / runTuples()});
+  chunk_per_file   = ((total_tuples + total_file - 1) / total_file) * TUPLE_SIZE;
+  if (stream)
+    chunk_per_file = runTuples() * TUPLE_SIZE;
+  next_tmp_file    = 0;
+  inmemory_tuples  = 0;
 
 #ifdef VERBOSE
-  printf("file_size: %zu total_tuples: %zu key_per_thread: %zu\n", file_size, total_tuples, chunk_per_thread / TUPLE_SIZE);
+  printf("threads: %d memory: %zu chunk: %zu read_buf: %zu write_buf: %zu\n",
+         max_threads, memory_budget, file_threshold, buffer_size, w_buffer_size);
+  if (stream)
+    printf("file_size: unknown(stream) key_per_file: %zu\n", chunk_per_file / TUPLE_SIZE);
+  else
+    printf("file_size: %zu total_tuples: %zu key_per_file: %zu\n", file_size, total_tuples, chunk_per_file / TUPLE_SIZE);
   auto startTime = high_resolution_clock::now();
 #endif
 
   // read data from input file & start sorting
-  if (total_file == 1) {// input <= 1GB : inmemory sorting & direct writing
-    tuples = new TUPLETYPE[chunk_per_file/TUPLE_SIZE];
-
-    #pragma omp parallel for num_threads(MAX_THREADS)
-    for (size_t i = 0; i < MAX_THREADS; i++)
-      readFromFile(input_fd, &tuples[i*chunk_per_thread/TUPLE_SIZE], chunk_per_thread, i*chunk_per_thread);
-    // readFromFile(input_fd, tuples, file_size, 0);
-
-    parallelSort(tuples, total_tuples);
-  } else if (total_file == 2) {
-    tuples = new TUPLETYPE[file_size/TUPLE_SIZE];
-    chunk_per_thread = file_size / MAX_THREADS;
-
-    #pragma omp parallel for num_threads(MAX_THREADS)
-    for (size_t i = 0; i < MAX_THREADS; i++)
-      readFromFile(input_fd, &tuples[i*chunk_per_thread/TUPLE_SIZE], chunk_per_thread, i*chunk_per_thread);
-    // readFromFile(input_fd, tuples, file_size, 0);
-
-    parallelSort(tuples, total_tuples);
-  } else {// total_file > 2 : create .tmp files
-    tuples = new TUPLETYPE[chunk_per_file/TUPLE_SIZE];
-    for (int i = 0; i < total_file - 1; i++)
-      for (int j = 0; j < 2; j++)
-        read_buf[i][j] = new TUPLETYPE[BUFFER_SIZE/TUPLE_SIZE];
-
-    for (int cur_file = 0; cur_file < total_file; cur_file++) {
-      #pragma omp parallel for num_threads(MAX_THREADS)
-      for (size_t i = 0; i < MAX_THREADS; i++)
-        readFromFile(input_fd, &tuples[i*chunk_per_thread/TUPLE_SIZE], chunk_per_thread, (chunk_per_file*cur_file) + (i*chunk_per_thread));
-      // readFromFile(input_fd, tuples, chunk_per_file, (chunk_per_file*cur_file));
-
-      if (cur_file != total_file - 1) {// create total_file - 1 .tmp files. leave 1 in memory.
-        string outfile = to_string(cur_file) + ".tmp";
-        tmp_fd[cur_file] = open(outfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0777);
-        if (tmp_fd[cur_file] == -1) {
-          printf("error: open %s file\n", outfile.c_str());
-          exit(0);
-        }
-
-        tmp_files.push_back(FILEINFO(outfile, 0, chunk_per_file - 2*BUFFER_SIZE));
-
-        parallelSort(tuples, chunk_per_file/TUPLE_SIZE);
-
-        memcpy(read_buf[cur_file][0], tuples, BUFFER_SIZE);
-        memcpy(read_buf[cur_file][1], tuples + BUFFER_SIZE/TUPLE_SIZE, BUFFER_SIZE);
-        ftruncate(tmp_fd[cur_file], chunk_per_file - 2*BUFFER_SIZE);
-        writeToFile(tmp_fd[cur_file], tuples + 2*BUFFER_SIZE/TUPLE_SIZE, chunk_per_file - 2*BUFFER_SIZE, 0);
-        close(tmp_fd[cur_file]);
-      }
-      parallelSort(tuples, chunk_per_file/TUPLE_SIZE);
-    }
+  uint64_t phase = STATS::now();
+  size_t out_tuples;// fewer than total_tuples with --unique or a selection
+  if (selects()) {// one read pass, only survivors are sorted
+    out_tuples = selectTuples(input_fd, stream);
+    stats.phase("select", phase);
+    phase = STATS::now();
+    out_tuples = cutSelected(tuples, out_tuples);
+    stats.phase("sort", phase);
+    delete [] tags;
+    tags = NULL;
+    file_size = out_tuples * TUPLE_SIZE;
+  } else if (inmemory) {// input <= 2GB and fits the budget : inmemory sorting & direct writing
+#ifdef MMAP_INPUT
+    // sort tags against the mapped input. tuples are gathered from the mapping at write time.
+    mapped = mapInput(input_fd, total_tuples * TUPLE_SIZE);
+    stats.read(input_fd, total_tuples * TUPLE_SIZE);
+    stats.phase("map", phase);
+    phase = STATS::now();
+    tags = new TAGTYPE[total_tuples];
+    tagSort(mapped, total_tuples, tags);
+    out_tuples = (unique_keys ? uniqueKeys(tags, total_tuples) : total_tuples);
+    stats.phase("sort", phase);
+#else
+    tuples = allocTuples(total_tuples);
+    if (sortsTags())
+      tags = new TAGTYPE[total_tuples];
+    parallelRead(input_fd, tuples, total_tuples, 0);
+    stats.phase("read", phase);
+    phase = STATS::now();
+    sortChunk(tuples, total_tuples);
+    out_tuples = (unique_keys ? uniqueKeys(tuples, total_tuples) : total_tuples);
+    stats.phase("sort", phase);
+    delete [] tags;
+    tags = NULL;
+#endif
+  } else {// larger than 2 chunks, the budget, or unknown : create .tmp files
+    generateRuns(input_fd, stream);
+    if (stream)
+      file_size = total_tuples * TUPLE_SIZE;
+    out_tuples = inmemory_tuples;// if no run was spilled
+    stats.phase("run generation", phase);
   }
 
+  // a stream that fit in one chunk is sorted inmemory like a small file.
+  int read_bufs = 0;
+  TUPLETYPE *read_buf[max(1, merge_plan.fan_in)][2];
+  for (; !tmp_files.empty() && read_bufs < min(merge_plan.fan_in, (int)tmp_files.size()); read_bufs++)
+    for (int j = 0; j < 2; j++)
+      read_buf[read_bufs][j] = allocTuples(merge_plan.run_buf/TUPLE_SIZE);
+
 #ifdef VERBOSE
   auto stopTime = high_resolution_clock::now();
   auto duration = duration_cast<milliseconds>(stopTime - startTime);
@@ -92,23 +121,42 @@ int main(int argc, char* argv[])
 #endif
 
   // open output file.
-  int output_fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0777);
+  // --unique merges read parts of the output back to close gaps between them.
+  int output_fd = (stdout_fd != -1 ? stdout_fd
+                   : openFile(argv[arg+1], (unique_keys ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC, 0777));
   if (output_fd == -1) {
     printf("error: open output file\n");
-    exit(0);
+    exit(1);
   }
-  ftruncate(output_fd, file_size);
+  if (seekable(output_fd))
+    ftruncate(output_fd, file_size);
 
   // flush to output file.
-  if (total_file <= 2) {
-    writeToFile(output_fd, tuples, file_size, 0);
+  phase = STATS::now();
+  if (tmp_files.empty()) {
+#ifdef MMAP_INPUT
+    if (tags != NULL) {
+      gatherToFile(output_fd, mapped, tags, out_tuples);
+      delete [] tags;
+      tags = NULL;
+      if (mapped != NULL)
+        munmap(mapped, total_tuples * TUPLE_SIZE);
+    } else {// stream input
+      writeToFile(output_fd, tuples, out_tuples * TUPLE_SIZE, 0);
+    }
+#else
+    writeToFile(output_fd, tuples, out_tuples * TUPLE_SIZE, 0);
+#endif
+    stats.phase("write", phase);
   } else {
-    externalSort(output_fd, read_buf);
-    for (int i = 0; i < total_file - 1; i++) {
+    out_tuples = externalSort(output_fd, read_buf);
+    for (int i = 0; i < read_bufs; i++) {
       for (int j = 0; j < 2; j++)
-        delete[] read_buf[i][j];
+        freeTuples(read_buf[i][j]);
     }
   }
+  if (out_tuples < total_tuples && seekable(output_fd))
+    ftruncate(output_fd, out_tuples * TUPLE_SIZE);
 
 #ifdef VERBOSE
   auto stopTime2 = high_resolution_clock::now();
@@ -117,138 +165,1005 @@ int main(int argc, char* argv[])
 #endif
 
   // free
-  delete [] tuples;
+  freeTuples(tuples);
   // close input file.
-  close(input_fd);
+  closeFile(input_fd);
   // close output file.
-  close(output_fd);
+  closeFile(output_fd);
+  stats.phase("total", start);
+  stats.write();
 
   return 0;
 }
 
-void parallelSort(TUPLETYPE* tuples, size_t count)
+int configure(int argc, char* argv[])
+{
+  // defaults < EXTSORT_* environment < options. -a (EXTSORT_AUTO=1) replaces the defaults
+  // with ones tuned to this host. returns index of the first non-option argument.
+  const char *keys = "tmcbwskFT";
+  const char *env[] = {"EXTSORT_THREADS", "EXTSORT_MEMORY", "EXTSORT_CHUNK", "EXTSORT_BUFFER", "EXTSORT_W_BUFFER",
+                       "EXTSORT_STATS", "EXTSORT_TOP", "EXTSORT_FROM", "EXTSORT_TO"};
+  const char *value[9];
+  const option flags[] = {{"stable", no_argument, NULL, 'S'}, {"unique", no_argument, NULL, 'u'},
+                          {"top", required_argument, NULL, 'k'}, {"from", required_argument, NULL, 'F'},
+                          {"to", required_argument, NULL, 'T'}, {NULL, 0, NULL, 0}};
+  auto envFlag = [](const char *name) { const char *v = getenv(name); return v != NULL && strcmp(v, "0") != 0; };
+  bool auto_tune = envFlag("EXTSORT_AUTO");
+  int opt;
+
+  stable_ties = envFlag("EXTSORT_STABLE");
+  unique_keys = envFlag("EXTSORT_UNIQUE");
+  for (int i = 0; i < 9; i++)
+    value[i] = getenv(env[i]);
+  while ((opt = getopt_long(argc, argv, "aSut:m:c:b:w:s:k:", flags, NULL)) != -1) {
+    if (opt == 'a')
+      auto_tune = true;
+    else if (opt == 'S')
+      stable_ties = true;
+    else if (opt == 'u')
+      unique_keys = true;
+    else if (opt != '?')
+      value[strchr(keys, opt) - keys] = optarg;
+    else
+      return argc;// prints usage
+  }
+
+  if (auto_tune)
+    autoTune();
+  if (value[0]) max_threads    = atoi(value[0]);
+  if (value[1]) memory_budget  = parseSize(value[1]);
+  if (value[2]) file_threshold = parseSize(value[2]);
+  if (value[3]) buffer_size    = parseSize(value[3]);
+  if (value[4]) w_buffer_size  = parseSize(value[4]);
+  if (value[5]) stats.path     = value[5];
+  if (value[6]) top_tuples     = parseSize(value[6]);
+
+  // keys are hex, a prefix stands for the smallest key starting with it.
+  range_to.clear();
+  select_range = (value[7] || value[8]);
+  if ((value[7] && !parseKey(value[7], range_from)) || (value[8] && !parseKey(value[8], range_to))) {
+    printf("error: keys are up to %zu hex digits\n", 2 * KEY_SIZE);
+    exit(1);
+  }
+
+  if (max_threads < 1 || file_threshold < TUPLE_SIZE || buffer_size < TUPLE_SIZE) {
+    printf("error: need at least 1 thread and a tuple per chunk & read buffer\n");
+    exit(1);
+  }
+  if (w_buffer_size / max_threads < DIRECT_ALIGN + TUPLE_SIZE) {
+    printf("error: write buffer too small for %d threads\n", max_threads);
+    exit(1);
+  }
+  if (runTuples() == 0) {
+    printf("error: memory budget holds no run(%zu bytes per tuple)\n",
+           RUN_BUFFERS * TUPLE_SIZE + sortOverhead(sortsTags()));
+    exit(1);
+  }
+
+  return optind;
+}
+
+size_t parseSize(const char *str)
+{
+  // decimal units like the rest of the program: 1G = 1000000000 bytes.
+  // anything but a number and one optional unit is an error, not 0.
+  char *unit;
+  double size = strtod(str, &unit);
+  if (unit == str || !(size >= 0) || (*unit != '\0' && (strchr("KMGT", toupper(*unit)) == NULL || unit[1] != '\0'))) {
+    printf("error: size %s is not a number with an optional K/M/G/T unit\n", str);
+    exit(1);
+  }
+  switch (toupper(*unit)) {
+    case 'T': size *= 1e3;// fall through
+    case 'G': size *= 1e3;// fall through
+    case 'M': size *= 1e3;// fall through
+    case 'K': size *= 1e3;
+  }
+  return (size_t)size;
+}
+
+void autoTune()
+{
+  // every core we may run on, and 90% of the cgroup (v2 or v1) or physical memory limit.
+  cpu_set_t cpus;
+  if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0)
+    max_threads = CPU_COUNT(&cpus);
+  else
+    max_threads = max(1u, thread::hardware_concurrency());
+
+  size_t limit = (size_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+  vector<string> files = {"/sys/fs/cgroup/memory.max", "/sys/fs/cgroup/memory/memory.limit_in_bytes"};
+  FILE *fp = fopen("/proc/self/cgroup", "r");
+  char line[4096];
+  while (fp != NULL && fgets(line, sizeof(line), fp) != NULL) {// our own cgroup, if visible
+    line[strcspn(line, "\n")] = '\0';
+    if (strncmp(line, "0::", 3) == 0)
+      files.push_back(string("/sys/fs/cgroup") + (line + 3) + "/memory.max");
+    else if (strstr(line, ":memory:") != NULL)
+      files.push_back(string("/sys/fs/cgroup/memory") + (strstr(line, ":memory:") + 8) + "/memory.limit_in_bytes");
+  }
+  if (fp != NULL)
+    fclose(fp);
+  for (size_t i = 0; i < files.size(); i++) {
+    unsigned long long value;
+    if ((fp = fopen(files[i].c_str(), "r")) == NULL)
+      continue;
+    if (fscanf(fp, "%llu", &value) == 1)// "max" means no limit
+      limit = min(limit, (size_t)value);
+    fclose(fp);
+  }
+
+  // every size keeps its default ratio to the budget.
+  memory_budget  = limit / 10 * 9;
+  file_threshold = (size_t)((double)FILE_THRESHOLD * memory_budget / MEMORY_BUDGET);
+  buffer_size    = (size_t)((double)BUFFER_SIZE * memory_budget / MEMORY_BUDGET);
+  w_buffer_size  = (size_t)((double)W_BUFFER_SIZE * memory_budget / MEMORY_BUDGET);
+}
+
+size_t runTuples()
+{
+  // RUN_BUFFERS chunks (and tags & scratch of the one being sorted) must fit in the budget,
+  // beside the batch of blocks a spilled run is encoded in.
+  size_t per_tuple = RUN_BUFFERS * TUPLE_SIZE + sortOverhead(sortsTags()), budget = memory_budget;
+#ifdef COMPRESS_RUNS
+  budget -= min(budget, encodeScratch());
+#endif
+  size_t count = min(file_threshold / TUPLE_SIZE, budget / per_tuple);
+  return (sortsTags() ? min(count, MAX_TAG_TUPLES) : count);
+}
+
+bool sortsInMemory(size_t tuples)
+{
+  // the whole input and what sorting it takes beside must fit in the budget. a mapped input
+  // counts too: MAP_POPULATE faults all of it in.
+#ifdef MMAP_INPUT
+  const bool tagged = true;
+#else
+  const bool tagged = sortsTags();
+#endif
+  if (tagged && tuples > MAX_TAG_TUPLES)
+    return false;
+  return tuples * (TUPLE_SIZE + sortOverhead(tagged)) <= memory_budget;
+}
+
+MERGEPLAN planMerge(int runs, size_t run_size, size_t sort_size)
+{
+  MERGEPLAN plan;
+  const size_t write_size = 2 * w_buffer_size;
+  const size_t min_run    = 2 * MIN_BUFFER_SIZE;// smallest double read buffer per run
+
+  plan.runs    = runs;
+  plan.passes  = 1;
+  plan.preload = 0;
+  if (memory_budget >= write_size + run_size + (runs - 1) * min_run) {
+    // single pass: last run stays inmemory, the rest share what is left.
+    // a quarter goes to read buffers, the rest keeps heads of runs off the disk.
+    size_t per_run = (memory_budget - write_size - run_size) / (runs - 1);
+    plan.keep_last = true;
+    plan.fan_in    = runs;
+    plan.run_buf   = min(buffer_size, max(MIN_BUFFER_SIZE, per_run / 4)) / TUPLE_SIZE * TUPLE_SIZE;
+    plan.preload   = min(run_size, per_run - 2 * plan.run_buf);
+    // heads are kept while the other runs are generated, too.
+    plan.preload   = min(plan.preload, (memory_budget - sort_size) / (runs - 1)) / TUPLE_SIZE * TUPLE_SIZE;
+#ifdef CHECKPOINT
+    plan.preload   = 0;// a preloaded head would not survive a crash
+#endif
+  } else {
+    // spill every run. fan-in is bounded by the budget, so merge smallest runs
+    // into bigger ones (one pass each) until a single pass can finish.
+    if (memory_budget < write_size + 2 * min_run) {
+      printf("error: memory budget too small to merge\n");
+      exit(1);
+    }
+    plan.keep_last = false;
+    plan.fan_in    = min((size_t)runs, (memory_budget - write_size) / min_run);
+    plan.run_buf   = min(buffer_size, (memory_budget - write_size) / (2 * plan.fan_in)) / TUPLE_SIZE * TUPLE_SIZE;
+    if (runs > plan.fan_in)
+      plan.passes += (runs - plan.fan_in + plan.fan_in - 2) / (plan.fan_in - 1);
+  }
+  size_t min_slice = MIN_SLICE_SIZE;
+#ifdef DIRECT_IO
+  min_slice = max(min_slice, 4 * DIRECT_ALIGN);// whole blocks around the tuples of every slice
+#endif
+  plan.threads = max(1, min(max_threads, (int)(min(plan.run_buf, w_buffer_size) / min_slice)));
+#ifdef COMPRESS_RUNS
+  // a side of every thread's slice holds a decoded block, or a block that did not compress
+  // plus the O_DIRECT slack.
+  const size_t block_slice = BLOCK_BYTES + 3 * DIRECT_ALIGN;
+  if (plan.run_buf < block_slice) {
+    printf("error: read buffer too small for a compressed block\n");
+    exit(1);
+  }
+  plan.threads = min(plan.threads, (int)(plan.run_buf / block_slice));
+#endif
+
+  return plan;
+}
+
+void generateRuns(int input_fd, bool stream)
+{
+  // a stream's length is unknown: chunks are read until EOF, and the merge plan is made
+  // once runs are counted. runs are spilled without preloaded heads then.
+  size_t sort_size = RUN_BUFFERS * chunk_per_file// memory taken by generating runs
+                   + chunk_per_file / TUPLE_SIZE * sortOverhead(sortsTags());
+#ifdef COMPRESS_RUNS
+  sort_size += encodeScratch();
+#endif
+  if (!stream)
+    merge_plan = planMerge(total_file, chunk_per_file, sort_size);
+  else
+    merge_plan.keep_last = false;// decided after the last chunk
+
+  TUPLETYPE *chunk[RUN_BUFFERS];
+  size_t count[RUN_BUFFERS];
+  int id[RUN_BUFFERS];
+  for (int i = 0; i < RUN_BUFFERS; i++)
+    chunk[i] = allocTuples(chunk_per_file/TUPLE_SIZE);
+
+  // chunks to sort, in order. a stream goes on until EOF.
+  vector<int> todo;
+  for (int i = 0; !stream && i < total_file; i++)
+    todo.push_back(i);
+#ifdef CHECKPOINT
+  if (!stream) {// runs of an earlier ./run of this input, chunk buffers are scratch till then
+    vector<bool> done = resumeRuns(input_fd, chunk, chunk_per_file/TUPLE_SIZE);
+    todo.clear();
+    for (int i = 0; i < total_file; i++)
+      if (!done[i])
+        todo.push_back(i);
+  }
+#endif
+  if (sortsTags())
+    tags = new TAGTYPE[chunk_per_file/TUPLE_SIZE];
+  auto chunkAt = [&todo, stream](int t) {
+    return stream ? t : (t < (int)todo.size() ? todo[t] : total_file);
+  };
+  auto readChunk = [input_fd, stream](int file, TUPLETYPE *buf) -> size_t {
+    if (stream)// in order; short only at EOF
+      return readFromFile(input_fd, buf, chunk_per_file, 0) / TUPLE_SIZE;
+    if (file >= total_file)
+      return 0;
+    size_t count = min(chunk_per_file, total_tuples * TUPLE_SIZE - chunk_per_file * file) / TUPLE_SIZE;
+    parallelRead(input_fd, buf, count, chunk_per_file * file);
+    return count;
+  };
+
+  // while a chunk is sorted, the other buffer spills the previous run & reads the next chunk.
+  int t = 0;
+  id[0]    = chunkAt(0);
+  count[0] = readChunk(id[0], chunk[0]);
+  for (;; t++) {
+    int cur = t % RUN_BUFFERS, other = (t + 1) % RUN_BUFFERS;
+    future<void> io = async(launch::async, [&readChunk, &chunkAt, &chunk, &count, &id, t, other]() {
+      if (t > 0)
+        spillRun(chunk[other], count[other], merge_plan.keep_last, id[other]);
+      id[other]    = chunkAt(t + 1);
+      count[other] = readChunk(id[other], chunk[other]);
+    });
+    if (stream)
+      total_tuples += count[cur];
+    sortChunk(chunk[cur], count[cur]);
+    if (unique_keys)// duplicates within the chunk never reach the disk
+      count[cur] = uniqueKeys(chunk[cur], count[cur]);
+    uint64_t wait = STATS::now();
+    io.get();
+    stats.run_wait_ns += STATS::now() - wait;
+    if (count[other] == 0)
+      break;
+  }
+  if (stream)
+    total_file = t + 1;
+
+  // last run never touches the disk if it is kept.
+  const int last = t % RUN_BUFFERS;
+  tuples = chunk[last];
+  freeTuples(chunk[(t + 1) % RUN_BUFFERS]);
+  delete [] tags;
+  tags = NULL;
+  if (stream) {
+    if (total_file == 1) {// fit in one chunk: already sorted in `tuples`
+      inmemory_tuples = count[last];
+      return;
+    }
+    merge_plan = planMerge(total_file, chunk_per_file, sort_size);
+    merge_plan.preload = 0;// spilled runs are on disk already
+  }
+  use_uring = probeUring();
+#ifdef VERBOSE
+  printf("merge I/O: %s\n", use_uring ? "io_uring" : "pread/pwrite");
+  printf("runs: %d fan_in: %d passes: %d threads: %d run_buf: %zu preload: %zu keep_last: %d\n",
+         merge_plan.runs, merge_plan.fan_in, merge_plan.passes, merge_plan.threads,
+         merge_plan.run_buf, merge_plan.preload, merge_plan.keep_last);
+#endif
+
+  if (merge_plan.keep_last) {
+    inmemory_tuples = count[last];
+    inmemory_chunk  = id[last];
+  } else {// every run is on disk. hand sort chunk memory over to merge buffers.
+    if (count[last] > 0)// none if every chunk was resumed
+      spillRun(tuples, count[last], false, id[last]);
+    freeTuples(tuples);
+    tuples = NULL;
+  }
+}
+
+void parallelRead(int fd, TUPLETYPE *buf, size_t count, size_t offset)
+{
+  // split by tuples so that no thread reads a partial tuple.
+  #pragma omp parallel for num_threads(max_threads)
+  for (int i = 0; i < max_threads; i++) {
+    size_t start = count * i / max_threads, end = count * (i+1) / max_threads;
+    PINNED pin(i, max_threads);
+    readFromFile(fd, &buf[start], (end - start) * TUPLE_SIZE, offset + start * TUPLE_SIZE);
+  }
+}
+
+TUPLETYPE* mapInput(int fd, size_t nbyte)
+{
+  if (nbyte == 0)
+    return NULL;
+  void *addr = mmap(NULL, nbyte, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  if (addr == MAP_FAILED) {
+    printf("error: mmap input file\n");
+    exit(1);
+  }
+  madvise(addr, nbyte, MADV_HUGEPAGE);// only honored where the filesystem supports it
+  return (TUPLETYPE*)addr;
+}
+
+void gatherToFile(int fd, const TUPLETYPE *tuples, const TAGTYPE *tags, size_t count)
+{
+  TUPLETYPE *write_buf[2];
+  const int parts = (seekable(fd) ? max_threads : 1);// a pipe takes output in order only
+  const size_t w_slice = w_buffer_size / parts / TUPLE_SIZE * TUPLE_SIZE;// bytes
+
+  for (int i = 0; i < 2; i++)
+    write_buf[i] = allocTuples(w_buffer_size/TUPLE_SIZE);
+
+  // each thread gathers its share of sorted tags into its own part of the output.
+  #pragma omp parallel for num_threads(parts)
+  for (int p = 0; p < parts; p++) {
+    size_t start = count * p / parts, end = count * (p+1) / parts;
+    RUNWRITER out(fd, write_buf[0] + p*w_slice/TUPLE_SIZE, write_buf[1] + p*w_slice/TUPLE_SIZE,
+                  w_slice, start * TUPLE_SIZE);
+    for (size_t i = start; i < end; i++)
+      out.push(tuples[tags[i].idx]);
+    out.finish();
+  }
+
+  for (int i = 0; i < 2; i++)
+    freeTuples(write_buf[i]);
+}
+
+void spillRun(TUPLETYPE *run, size_t count, bool preload, int chunk)
 {
-  kx::radix_sort(tuples, tuples+count, OneByteRadixTraits());
-  size_t partition[MAX_THREADS];
+  string outfile = to_string(next_tmp_file++) + ".tmp";
+  size_t nbyte = count * TUPLE_SIZE, preloaded = 0;
+  TUPLETYPE *head = NULL;
 
-  #pragma omp parallel for num_threads(MAX_THREADS)
-  for (int i = 1; i < MAX_THREADS; i++) {
-    unsigned char key[100];
-    memset(key, 0, sizeof(key));
-    key[0] = i * 256/MAX_THREADS;
-    TUPLETYPE tmp(key);
-    auto idx = lower_bound(tuples, tuples + count, tmp);
-    partition[i-1] = idx - tuples;
+  // head of the run stays inmemory instead of going through the disk.
+  if (preload && merge_plan.preload) {
+    preloaded = min(nbyte, merge_plan.preload);
+    head = allocTuples(preloaded/TUPLE_SIZE);
+    memcpy(head, run, preloaded);
   }
-  partition[MAX_THREADS-1] = count;
 
-  #pragma omp parallel for num_threads(MAX_THREADS)
-  for (int i = 0; i < MAX_THREADS; i++) {
-    size_t prev = i == 0 ? 0 : partition[i-1];
-    kx::radix_sort(tuples+prev, tuples+partition[i], RadixTraits());
+  int fd = openFile(outfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0777);
+  if (fd == -1) {
+    printf("error: open %s file\n", outfile.c_str());
+    exit(1);
   }
+  tmp_files.push_back(FILEINFO(outfile, 0, nbyte - preloaded, head, preloaded));
+  tmp_files.back().chunks.push_back(chunk);
+#ifdef COMPRESS_RUNS
+  writeBlocks(fd, run + preloaded/TUPLE_SIZE, count - preloaded/TUPLE_SIZE, tmp_files.back().blocks);
+#ifdef VERBOSE
+  printf("%s: %zu bytes compressed to %zu\n", outfile.c_str(), nbyte - preloaded,
+         tmp_files.back().blocks.back());
+#endif
+#else
+  ftruncate(fd, nbyte - preloaded);
+  writeToFile(fd, run + preloaded/TUPLE_SIZE, nbyte - preloaded, 0);
+#endif
+#ifdef CHECKPOINT
+  fdatasync(fd);
+#endif
+  closeFile(fd);
+
+  vector<MERGEKEY> &index = tmp_files.back().index;
+  for (size_t i = 0; i < count; i += INDEX_STRIDE) {
+    index.push_back(MERGEKEY());
+    index.back().load(run[i]);
+  }
+#ifdef CHECKPOINT
+  FILEINFO &file = tmp_files.back();
+  file.checksum  = runSum(run, count, 0);
+  file.first_key = keyHex(run[0]);
+  file.last_key  = keyHex(run[count-1]);
+  recordRun(file);
+#endif
 }
 
-void externalSort(int output_fd, TUPLETYPE* read_buf[][2])
+size_t externalSort(int output_fd, TUPLETYPE* read_buf[][2])
 {
-  int written_files = total_file - 1;
-  bool is_done[written_files];
-  int tmp_fd[written_files], tmp_swi[written_files];
-  size_t total_write = 0, write_idx = 0, write_swi = 0;
-  future<size_t> read[written_files], write;
-  priority_queue<pair<TUPLETYPE*, pair<int, size_t> >, vector<pair<TUPLETYPE*, pair<int, size_t> > >, pq_cmp > queue;// {TUPLE, {file_idx, buf_idx}}
-  bool is_first_writing = true, is_first_reading[written_files];
   TUPLETYPE *write_buf[2];
+  auto firstChunk = [](const FILEINFO &file) { return *min_element(file.chunks.begin(), file.chunks.end()); };
+
+  for (int i = 0; i < 2; i++)
+    write_buf[i] = allocTuples(w_buffer_size/TUPLE_SIZE);
+  if (stable_ties)// runs in input order, so a tie goes to the earlier run
+    sort(tmp_files.begin(), tmp_files.end(),
+         [&firstChunk](const FILEINFO &a, const FILEINFO &b) { return firstChunk(a) < firstChunk(b); });
+
+  // intermediate passes: too many runs for one pass. merge the smallest ones first.
+  while ((int)tmp_files.size() > merge_plan.fan_in) {
+    int group = min(merge_plan.fan_in, (int)tmp_files.size() - merge_plan.fan_in + 1), from = 0;
+    size_t merged_size = 0;
+
+    if (stable_ties) {
+      // only adjacent runs, or the merged run would have no place in input order. the
+      // smallest window of them is moved to the front, and the merged run put back there.
+      size_t window = 0, best = SIZE_MAX;
+      for (int i = 0; i < (int)tmp_files.size(); i++) {
+        window += tmp_files[i].size - (i >= group ? tmp_files[i - group].size : 0);
+        if (i >= group - 1 && window < best) {
+          best = window;
+          from = i - group + 1;
+        }
+      }
+      rotate(tmp_files.begin(), tmp_files.begin() + from, tmp_files.begin() + from + group);
+    } else {
+      sort(tmp_files.begin(), tmp_files.end(),
+           [](const FILEINFO &a, const FILEINFO &b) { return a.size < b.size; });
+    }
+    for (int i = 0; i < group; i++)
+      merged_size += tmp_files[i].size;
+
+    FILEINFO merged(to_string(next_tmp_file++) + ".tmp", 0, merged_size);
+    for (int i = 0; i < group; i++)
+      merged.chunks.insert(merged.chunks.end(), tmp_files[i].chunks.begin(), tmp_files[i].chunks.end());
+    int merged_fd = openFile(merged.file_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0777);
+    if (merged_fd == -1) {
+      printf("error: open %s file\n", merged.file_name.c_str());
+      exit(1);
+    }
+    ftruncate(merged_fd, merged_size);
+    uint64_t start = STATS::now();
+    merged.size = parallelMerge(group, false, read_buf, write_buf, merged_fd, &merged) * TUPLE_SIZE;
+    if (merged.size < merged_size)// --unique
+      ftruncate(merged_fd, merged.size);
+    stats.merges.push_back({group, merged_size, STATS::now() - start});
+    stats.phase("merge pass " + to_string(stats.merges.size()), start);
+#ifdef CHECKPOINT
+    fdatasync(merged_fd);
+    merged.first_key = tmp_files[0].first_key;
+    merged.last_key  = tmp_files[0].last_key;
+    for (int i = 1; i < group; i++) {
+      merged.first_key = min(merged.first_key, tmp_files[i].first_key);
+      merged.last_key  = max(merged.last_key, tmp_files[i].last_key);
+    }
+    recordRun(merged);// replaces the runs it was merged from
+#endif
+    closeFile(merged_fd);
+
+    for (int i = 0; i < group; i++)
+      unlink(tmp_files[i].file_name.c_str());
+    tmp_files.erase(tmp_files.begin(), tmp_files.begin() + group);
+    tmp_files.insert(tmp_files.begin() + from, merged);
+  }
+
+  // final pass straight into the output file.
+  uint64_t start = STATS::now();
+  size_t written = parallelMerge(tmp_files.size(), inmemory_tuples > 0, read_buf, write_buf, output_fd, NULL);
+  stats.merges.push_back({(int)tmp_files.size() + (inmemory_tuples > 0 ? 1 : 0),
+                          total_tuples * TUPLE_SIZE, STATS::now() - start});
+  stats.phase("final merge", start);
+#ifdef CHECKPOINT
+  closeManifest(output_fd);
+#endif
+
+  for (size_t i = 0; i < tmp_files.size(); i++) {
+    unlink(tmp_files[i].file_name.c_str());
+    freeTuples(tmp_files[i].head);
+  }
+  tmp_files.clear();
 
   for (int i = 0; i < 2; i++)
-    write_buf[i] = new TUPLETYPE[W_BUFFER_SIZE/TUPLE_SIZE];
-
-  // open created .tmp files
-  for (int i = 0; i < written_files; i++) {
-    is_done[i] = false;
-    is_first_reading[i] = true;
-    tmp_swi[i] = 0;
-    tmp_fd[i]  = open(tmp_files[i].file_name.c_str(), O_RDONLY);
-    if (tmp_fd[i] == -1) {
-      printf("error: open %s file\n", tmp_files[i].file_name.c_str());
-      exit(0);
+    freeTuples(write_buf[i]);
+
+  return written;
+}
+
+size_t parallelMerge(int count, bool with_memory_run, TUPLETYPE* read_buf[][2],
+                     TUPLETYPE* write_buf[2], int out_fd, FILEINFO *out)
+{
+  const int runs    = count + (with_memory_run ? 1 : 0);
+  // a pipe takes output in order only. so does --unique output that cannot be read back(stdout).
+  const bool in_order = !seekable(out_fd) || (unique_keys && (fcntl(out_fd, F_GETFL) & O_ACCMODE) == O_WRONLY);
+  const int threads   = (in_order ? 1 : merge_plan.threads);
+  const size_t slice   = merge_plan.run_buf / threads / TUPLE_SIZE;// tuples
+  const size_t w_slice = w_buffer_size / threads / TUPLE_SIZE * TUPLE_SIZE;// bytes
+  vector<MERGEKEY> samples, splitter;
+  vector<vector<size_t> > bound(runs, vector<size_t>(threads + 1));
+  vector<size_t> out_start(threads + 1, 0);
+  vector<vector<MERGEKEY> > index_part(threads);
+  vector<uint64_t> sum_part(threads, 0);
+  vector<size_t> written(threads);
+  vector<int> rank(runs);// --stable: first chunk of each run
+  for (int i = 0; i < runs; i++)
+    rank[i] = (i < count ? *min_element(tmp_files[i].chunks.begin(), tmp_files[i].chunks.end()) : inmemory_chunk);
+
+  // choose splitters from sampled keys of every run, so each thread gets
+  // about the same number of tuples whatever the key distribution is.
+  for (int i = 0; i < count; i++)
+    samples.insert(samples.end(), tmp_files[i].index.begin(), tmp_files[i].index.end());
+  for (size_t i = 0; with_memory_run && i < inmemory_tuples; i += INDEX_STRIDE) {
+    samples.push_back(MERGEKEY());
+    samples.back().load(tuples[i]);
+  }
+  sort(samples.begin(), samples.end());
+  for (int p = 1; p < threads && !samples.empty(); p++)
+    splitter.push_back(samples[samples.size() * p / threads]);
+  while ((int)splitter.size() < threads - 1) {// no tuples at all
+    splitter.push_back(MERGEKEY());
+    splitter.back().clear();
+  }
+
+  // every run is cut at the same splitters.
+  #pragma omp parallel for num_threads(max_threads)
+  for (int i = 0; i < runs; i++) {
+    if (i < count) {
+      int fd = openFile(tmp_files[i].file_name.c_str(), O_RDONLY);
+      bound[i][threads] = tmp_files[i].tuples();
+      for (int p = 1; p < threads; p++)
+        bound[i][p] = runLowerBound(tmp_files[i], fd, splitter[p-1]);
+      closeFile(fd);
+    } else {
+      bound[i][threads] = inmemory_tuples;
+      for (int p = 1; p < threads; p++)
+        bound[i][p] = lower_bound(tuples, tuples + inmemory_tuples, splitter[p-1],
+                                  [](const TUPLETYPE &t, const MERGEKEY &key) {
+                                    MERGEKEY k; k.load(t); return k < key;
+                                  }) - tuples;
     }
+    bound[i][0] = 0;
+  }
+  for (int p = 1; p <= threads; p++) {
+    out_start[p] = out_start[p-1];
+    for (int i = 0; i < runs; i++)
+      out_start[p] += bound[i][p] - bound[i][p-1];
   }
 
-  for (int i = 0; i < written_files; i++)
-    queue.push({&read_buf[i][0][0], {i, 0}});
-  queue.push({&tuples[0], {written_files, 0}});
-
-  // sort external files by popping least key TUPLE from queue & write to output file
-  while (!queue.empty()) {
-    auto min_tuple = queue.top(); queue.pop();
-    int f_idx = min_tuple.second.first; size_t offset = min_tuple.second.second;
-    write_buf[write_swi][write_idx/TUPLE_SIZE] = *min_tuple.first;
-    write_idx += TUPLE_SIZE;
-
-    // write buffer is full. Flush to disk.
-    if (write_idx >= W_BUFFER_SIZE/TUPLE_SIZE) {
-      if (is_first_writing)
-        is_first_writing = false;
-      else
-        total_write += write.get();
-
-      if (total_write + write_idx < total_tuples * TUPLE_SIZE)
-        write = async(writeToFile, output_fd, write_buf[write_swi], write_idx, total_write);
-      else
-        total_write += writeToFile(output_fd, write_buf[write_swi], write_idx, total_write);
-      write_idx = 0;
-      write_swi = (write_swi+1) % 2;
+  // each thread merges its key range of every run into its own part of the output.
+  // with io_uring, its slices of read & write buffers are registered with its own ring.
+  #pragma omp parallel for num_threads(threads)
+  for (int p = 0; p < threads; p++) {
+    URING uring;
+    URING *ring = NULL;
+    if (use_uring && uring.init(count + 1)) {
+      vector<iovec> bufs;
+      for (int i = 0; i < count; i++)
+        for (int j = 0; j < 2; j++)
+          bufs.push_back({read_buf[i][j] + p*slice, slice * TUPLE_SIZE});
+      for (int j = 0; j < 2; j++)
+        bufs.push_back({write_buf[j] + p*w_slice/TUPLE_SIZE, w_slice});
+      uring.registerBuffers(bufs);
+      ring = &uring;
     }
 
-    // push next tuple of current poped one.
-    if (f_idx == written_files) {
-      if (offset + TUPLE_SIZE < chunk_per_file) {
-        queue.push({&tuples[offset/TUPLE_SIZE + 1], {f_idx, offset + TUPLE_SIZE}});
+    vector<RUNREADER> readers(runs);
+    for (int i = 0; i < count; i++)
+      readers[i].open(tmp_files[i], bound[i][p], bound[i][p+1],
+                      read_buf[i][0] + p*slice, read_buf[i][1] + p*slice, slice * TUPLE_SIZE, ring);
+    if (with_memory_run)
+      readers[count].openMemory(tuples + bound[count][p], bound[count][p+1] - bound[count][p]);
+    for (int i = 0; i < runs; i++)// first wait hands every queued read to the kernel at once.
+      readers[i].start();
+
+    RUNWRITER writer(out_fd, write_buf[0] + p*w_slice/TUPLE_SIZE, write_buf[1] + p*w_slice/TUPLE_SIZE,
+                     w_slice, out_start[p] * TUPLE_SIZE, out ? &index_part[p] : NULL, ring);
+    mergeRuns(&readers[0], runs, writer, stable_ties ? &rank[0] : NULL);
+    writer.finish();
+    written[p]  = writer.offset / TUPLE_SIZE - out_start[p];
+    sum_part[p] = writer.sum;
+    for (int i = 0; i < runs; i++)
+      readers[i].close();
+  }
+
+  size_t total = out_start[threads];
+  if (unique_keys)
+    total = closeGaps(out_fd, out_start, written, write_buf[0], w_buffer_size, index_part, sum_part);
+  for (int p = 0; out && p < threads; p++) {
+    out->index.insert(out->index.end(), index_part[p].begin(), index_part[p].end());
+    out->checksum += sum_part[p];
+  }
+
+  return total;
+}
+
+size_t closeGaps(int fd, const vector<size_t> &start, const vector<size_t> &written, TUPLETYPE *buf,
+                 size_t buf_size, vector<vector<MERGEKEY> > &index_part, vector<uint64_t> &sum_part)
+{
+  // --unique: each merge thread wrote its part where it starts if no key repeats. parts move
+  // down behind the one before in order, lowest block first, so nothing is overwritten
+  // before it is read. sparse index & checksum of a moved part are redone on the way.
+  const size_t buf_tuples = buf_size / TUPLE_SIZE;
+  size_t to = 0;
+
+  for (size_t p = 0; p < written.size(); to += written[p], p++) {
+    if (to == start[p])
+      continue;
+    index_part[p].clear();
+    sum_part[p] = 0;
+    for (size_t done = 0; done < written[p]; done += buf_tuples) {
+      size_t n = min(buf_tuples, written[p] - done);
+      if (readFromFile(fd, buf, n * TUPLE_SIZE, (start[p] + done) * TUPLE_SIZE) != n * TUPLE_SIZE) {
+        printf("error: read back merged tuples\n");
+        exit(1);
       }
-    } else {
-      if (offset + TUPLE_SIZE >= BUFFER_SIZE) {
-        if (!is_done[f_idx]) {
-          if (is_first_reading[f_idx])
-            is_first_reading[f_idx] = false;
-          else
-            tmp_files[f_idx].cur_offset += read[f_idx].get();
-
-          read[f_idx] = async(readFromFile, tmp_fd[f_idx], read_buf[f_idx][tmp_swi[f_idx]],
-                              BUFFER_SIZE, tmp_files[f_idx].cur_offset);
-          tmp_swi[f_idx] = (tmp_swi[f_idx]+1) % 2;
-          queue.push({&read_buf[f_idx][tmp_swi[f_idx]][0], {f_idx, 0}});
-
-          if (tmp_files[f_idx].cur_offset + BUFFER_SIZE >= tmp_files[f_idx].size)
-            is_done[f_idx] = true;
-        } else {
-          if (tmp_files[f_idx].cur_offset < tmp_files[f_idx].size) {
-            tmp_files[f_idx].cur_offset += read[f_idx].get();
-            tmp_swi[f_idx] = (tmp_swi[f_idx]+1) % 2;
-            queue.push({&read_buf[f_idx][tmp_swi[f_idx]][0], {f_idx, 0}});
-          }
-        }
-      } else {
-        queue.push({&read_buf[f_idx][tmp_swi[f_idx]][offset/TUPLE_SIZE+1], {f_idx, offset+TUPLE_SIZE}});
+      for (size_t i = (INDEX_STRIDE - (to + done) % INDEX_STRIDE) % INDEX_STRIDE; i < n; i += INDEX_STRIDE) {
+        index_part[p].push_back(MERGEKEY());
+        index_part[p].back().load(buf[i]);
       }
+#ifdef CHECKPOINT
+      for (size_t i = 0; i < n; i++)
+        sum_part[p] += tupleSum(buf[i], to + done + i);
+#endif
+      writeToFile(fd, buf, n * TUPLE_SIZE, (to + done) * TUPLE_SIZE);
     }
   }
 
-  for (int i = 0; i < 2; i++)
-    delete[] write_buf[i];
+  return to;
+}
 
-  for (int i = 0; i < written_files; i++)
-    close(tmp_fd[i]);
+size_t runLowerBound(const FILEINFO &file, int fd, const MERGEKEY &key)
+{
+  // sparse index narrows it down to one stride, binary search the rest.
+  const size_t count = file.tuples(), head_tuples = file.preloaded / TUPLE_SIZE;
+  size_t j  = lower_bound(file.index.begin(), file.index.end(), key) - file.index.begin();
+  size_t lo = (j == 0 ? 0 : (j-1) * INDEX_STRIDE + 1), hi = min(j * INDEX_STRIDE, count);
+  vector<TUPLETYPE> block;// last block decoded from a compressed run
+  vector<unsigned char> packed;
+  size_t cached = SIZE_MAX;
+
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    TUPLETYPE tuple;
+    MERGEKEY k;
+    if (mid < head_tuples) {
+      tuple = file.head[mid];
+    } else if (!file.blocks.empty()) {
+      size_t b = (mid - head_tuples) / COMPRESS_BLOCK;
+      if (b != cached)
+        readBlock(file, fd, cached = b, packed, block);
+      tuple = block[(mid - head_tuples) % COMPRESS_BLOCK];
+    } else {
+      readFromFile(fd, &tuple, TUPLE_SIZE, (mid - head_tuples) * TUPLE_SIZE);
+    }
+    k.load(tuple);
+    if (k < key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
 }
 
-size_t readFromFile(int fd, void *buf, size_t nbyte, size_t offset)
+void mergeRuns(RUNREADER *runs, int count, RUNWRITER &out, const int *rank)
+{
+  LOSERTREE tree(runs, count, rank);
+
+  // write least key TUPLE & replay its run's next tuple up the tree.
+  if (!unique_keys) {
+    while (!tree.empty()) {
+      out.push(*runs[tree.top()].head());
+      tree.pop();
+    }
+    return;
+  }
+  // --unique: a key equal to the last one written is dropped.
+  MERGEKEY last;
+  for (bool first = true; !tree.empty(); tree.pop()) {
+    if (first || last < tree.topKey()) {
+      out.push(*runs[tree.top()].head());
+      last  = tree.topKey();
+      first = false;
+    }
+  }
+}
+
+LOSERTREE::LOSERTREE(RUNREADER *runs, int count, const int *rank)
+  : runs(runs), count(count), rank(rank), tree(max(count, 1)), key(count)
+{
+  for (int i = 0; i < count; i++) {
+    if (runs[i].empty())
+      key[i].clear();
+    else
+      key[i].load(*runs[i].head());
+  }
+  if (count > 0)
+    tree[0] = build(1);
+}
+
+int LOSERTREE::build(int node)
+{
+  if (node >= count)
+    return node - count;
+
+  int left = build(2*node), right = build(2*node + 1);
+  if (beats(right, left)) {
+    tree[node] = left;
+    return right;
+  }
+  tree[node] = right;
+  return left;
+}
+
+void LOSERTREE::pop()
+{
+  int winner = tree[0];
+  if (runs[winner].next())
+    key[winner].load(*runs[winner].head());
+  else
+    key[winner].clear();
+
+  // only games on the path from the winner's leaf to the root can change.
+  for (int node = (winner + count) / 2; node > 0; node /= 2) {
+    if (beats(tree[node], winner))
+      swap(tree[node], winner);
+  }
+  tree[0] = winner;
+}
+
+void RUNREADER::open(const FILEINFO &file, size_t start, size_t end,
+                     TUPLETYPE *buf0, TUPLETYPE *buf1, size_t buf_size, URING *ring)
+{
+  const size_t head_tuples = file.preloaded / TUPLE_SIZE;
+
+  buf[0] = buf0;
+  buf[1] = buf1;
+  this->buf_size = buf_size;
+  this->ring = ring;
+  this->file = &file;
+  data = NULL;
+  len = pos = 0;
+  side = 0;
+  offset = (max(start, head_tuples) - head_tuples) * TUPLE_SIZE;
+  size   = (max(end, head_tuples) - head_tuples) * TUPLE_SIZE;
+
+  fd = -1;
+  if (offset < size) {
+    fd = openFile(file.file_name.c_str(), O_RDONLY);
+    if (fd == -1) {
+      printf("error: open %s file\n", file.file_name.c_str());
+      exit(1);
+    }
+  }
+
+  fill();
+  if (start < min(end, head_tuples)) {// merge from the preloaded head while the file is read.
+    data = file.head + start;
+    len  = min(end, head_tuples) - start;
+  }
+}
+
+void RUNREADER::openMemory(TUPLETYPE *run, size_t count)
+{
+  data = run;
+  len = count;
+  pos = 0;
+  fd = -1;
+  offset = size = 0;
+  file = NULL;
+  ring = NULL;
+}
+
+void RUNREADER::close()
+{
+  if (pending.active)
+    pending.get();
+  if (fd != -1)
+    closeFile(fd);
+  fd = -1;
+}
+
+bool RUNREADER::advance()
+{
+  // current tuples are drained. wait for the pending side & refill the other one.
+  len = pos = 0;
+  if (!pending.active)
+    return false;
+  size_t got = pending.get();
+  if (!file->blocks.empty()) {
+    // compressed run: decode into the drained side & read the next blocks into the same one.
+    if (got < skip[side] + file->blocks[last] - file->blocks[first]) {
+      printf("error: read %s file\n", file->file_name.c_str());
+      exit(1);
+    }
+    decodeBlocks(*file, (unsigned char*)alignUp(buf[side], alignOf(fd)) + skip[side], first, last, buf[1]);
+    len  = want[side] / TUPLE_SIZE;
+    data = buf[1] + (group / TUPLE_SIZE - first * COMPRESS_BLOCK);
+  } else {
+    len  = (min(got, skip[side] + want[side]) - min(got, skip[side])) / TUPLE_SIZE;
+    data = (TUPLETYPE*)(alignUp(buf[side], alignOf(fd)) + skip[side]);
+    side ^= 1;
+  }
+  fill();
+  if (ring != NULL)
+    ring->submit();
+
+  return len > 0;
+}
+
+void RUNREADER::fill()
+{
+  if (offset >= size)
+    return;
+  // with O_DIRECT, whole blocks go to an aligned spot of the side and tuples start skip bytes in.
+  const size_t align = alignOf(fd), slack = (align > 1 ? 3 * align : 0);
+  size_t from = offset, nbyte = min((buf_size - slack) / TUPLE_SIZE * TUPLE_SIZE, size - offset);
+  want[side] = nbyte;
+  if (!file->blocks.empty()) {
+    // compressed run: whole blocks, as many as fit here packed & in the other side decoded.
+    const vector<size_t> &blocks = file->blocks;
+    const size_t block_size = COMPRESS_BLOCK * TUPLE_SIZE;
+    first = last = offset / block_size;
+    while (last * block_size < size && (last + 1 - first) * block_size <= buf_size &&
+           blocks[last+1] - blocks[first] <= buf_size - slack)
+      last++;
+    if (last == first) {
+      printf("error: read buffer too small for a compressed block\n");
+      exit(1);
+    }
+    group = offset;
+    want[side] = min(last * block_size, size) - offset;
+    from  = blocks[first];
+    nbyte = blocks[last] - from;
+  }
+  skip[side] = from % align;
+  pending.read(ring, fd, alignUp(buf[side], align), (skip[side] + nbyte + align - 1) / align * align,
+               from - skip[side]);
+  offset += want[side];
+}
+
+RUNWRITER::RUNWRITER(int fd, TUPLETYPE *buf0, TUPLETYPE *buf1, size_t buf_size, size_t offset,
+                     vector<MERGEKEY> *index, URING *ring)
+  : idx(0), cur(0), fd(fd), offset(offset), index(index), sum(0), ring(ring)
+{
+  const size_t align = alignOf(fd);
+
+  buf[0] = buf0;
+  buf[1] = buf1;
+  cap  = (buf_size - (align > 1 ? align : 0)) / TUPLE_SIZE;
+  data = place(buf[0]);
+}
+
+TUPLETYPE* RUNWRITER::place(TUPLETYPE *side)
+{
+  // with O_DIRECT, tuples sit at the same offset within a block as in the file,
+  // so all but the partial blocks at both ends are written straight from the buffer.
+  const size_t align = alignOf(fd);
+  return (TUPLETYPE*)((char*)side + (offset % align + align - (uintptr_t)side % align) % align);
+}
+
+void RUNWRITER::flush()
+{
+  if (pending.active)
+    pending.get();
+  if (idx == 0)
+    return;
+
+  pending.write(ring, fd, data, idx * TUPLE_SIZE, offset);
+  if (ring != NULL)
+    ring->submit();
+  offset += idx * TUPLE_SIZE;
+  idx = 0;
+  cur ^= 1;
+  data = place(buf[cur]);
+}
+
+void RUNWRITER::finish()
+{
+  flush();
+  if (pending.active)
+    pending.get();
+}
+
+void PENDINGIO::read(URING *ring, int fd, void *buf, size_t nbyte, size_t offset)
+{
+  this->ring = ring;
+  writing = false;
+  if (ring != NULL)
+    slot = ring->read(fd, buf, nbyte, offset);
+  else
+    result = async(launch::async, readFromFile, fd, buf, nbyte, offset);
+  active = true;
+}
+
+void PENDINGIO::write(URING *ring, int fd, const void *buf, size_t nbyte, size_t offset)
+{
+  this->ring = ring;
+  writing = true;
+  if (ring != NULL)
+    slot = ring->write(fd, buf, nbyte, offset);
+  else
+    result = async(launch::async, writeToFile, fd, buf, nbyte, offset);
+  active = true;
+}
+
+size_t PENDINGIO::get()
+{
+  uint64_t start = STATS::now();
+  size_t done = (ring != NULL ? ring->wait(slot) : result.get());
+  STATS::add(writing ? stats.write_wait_ns : stats.read_wait_ns, STATS::now() - start);
+  active = false;
+  return done;
+}
+
+bool probeUring()
+{
+  // kernel may lack io_uring or forbid it (seccomp, sysctl). EXTSORT_IO=pread forces the fallback.
+  const char *io = getenv("EXTSORT_IO");
+  if (io != NULL && strcmp(io, "pread") == 0)
+    return false;
+  URING ring;
+  return ring.init(1);
+}
+
+int openFile(const char *path, int flags, mode_t mode)
+{
+  int fd = open(path, flags, mode);
+  stats.open(fd, path);
+#ifdef DIRECT_IO
+  // the O_DIRECT twin is opened after the file exists. filesystems without O_DIRECT
+  // (tmpfs) or fds past DIRECT_FDS just stay buffered.
+  if (fd != -1 && fd < (int)DIRECT_FDS)
+    direct_fd[fd] = open(path, (flags & ~(O_CREAT | O_TRUNC)) | O_DIRECT);
+#endif
+  return fd;
+}
+
+void closeFile(int fd)
+{
+  stats.close(fd);
+  if (directFd(fd) != -1) {
+    close(direct_fd[fd]);
+    direct_fd[fd] = -1;// before fd can be handed out again
+  }
+  close(fd);
+}
+
+int directFd(int fd)
+{
+  return (fd >= 0 && fd < (int)direct_fd.size()) ? direct_fd[fd] : -1;
+}
+
+bool seekable(int fd)
+{
+  return lseek(fd, 0, SEEK_CUR) != (off_t)-1;
+}
+
+size_t alignOf(int fd)
+{
+  return directFd(fd) == -1 ? 1 : DIRECT_ALIGN;
+}
+
+char* alignUp(void *ptr, size_t align)
+{
+  return (char*)(((uintptr_t)ptr + align - 1) / align * align);
+}
+
+static size_t plainRead(int fd, char *buf, size_t nbyte, size_t offset)
 {
-  posix_fadvise(fd, offset, nbyte, POSIX_FADV_WILLNEED);
-  posix_fadvise(fd, offset, nbyte, POSIX_FADV_SEQUENTIAL);
   size_t total_read = 0;
 
   while (nbyte) {
-    size_t ret  = pread(fd, buf, nbyte, offset);
+    ssize_t ret = pread(fd, buf + total_read, nbyte, offset);
+    if (ret < 0 && errno == ESPIPE)// pipe: in order, offset is implied
+      ret = read(fd, buf + total_read, nbyte);
+    if (ret <= 0)// EOF or error
+      break;
     nbyte      -= ret;
     offset     += ret;
     total_read += ret;
@@ -257,11 +1172,18 @@ size_t readFromFile(int fd, void *buf, size_t nbyte, size_t offset)
   return total_read;
 }
 
-size_t writeToFile(int fd, const void *buf, size_t nbyte, size_t offset)
+static size_t plainWrite(int fd, const char *buf, size_t nbyte, size_t offset)
 {
   size_t total_write = 0;
+
   while (nbyte) {
-    size_t ret   = pwrite(fd, buf, nbyte, offset);
+    ssize_t ret  = pwrite(fd, buf + total_write, nbyte, offset);
+    if (ret < 0 && errno == ESPIPE)// pipe: in order, offset is implied
+      ret = write(fd, buf + total_write, nbyte);
+    if (ret <= 0) {
+      printf("error: write to file\n");
+      exit(1);
+    }
     nbyte       -= ret;
     offset      += ret;
     total_write += ret;
@@ -270,9 +1192,82 @@ size_t writeToFile(int fd, const void *buf, size_t nbyte, size_t offset)
   return total_write;
 }
 
+// O_DIRECT wants block aligned offset, length & memory. partial blocks at both ends go
+// through the buffered fd, whole blocks through the twin. if buf is not aligned like
+// the file offset, whole blocks are copied through a small aligned bounce buffer.
+static size_t directTransfer(bool write, int fd, char *buf, size_t nbyte, size_t offset)
+{
+  static thread_local unique_ptr<char, void(*)(void*)> bounce(NULL, free);
+  const int dfd = directFd(fd);
+  size_t head = min(nbyte, (DIRECT_ALIGN - offset % DIRECT_ALIGN) % DIRECT_ALIGN);
+  size_t body = (nbyte - head) / DIRECT_ALIGN * DIRECT_ALIGN;
+  size_t done = (write ? plainWrite(fd, buf, head, offset) : plainRead(fd, buf, head, offset));
+
+  if (done < head)// EOF
+    return done;
+  if ((uintptr_t)(buf + head) % DIRECT_ALIGN == 0) {
+    size_t ret = (write ? plainWrite(dfd, buf + head, body, offset + head)
+                        : plainRead(dfd, buf + head, body, offset + head));
+    done += ret;
+    if (ret < body)
+      return done;
+  } else {
+    if (!bounce) {
+      void *ptr;
+      if (posix_memalign(&ptr, DIRECT_ALIGN, DIRECT_BOUNCE) != 0) {
+        printf("error: allocate bounce buffer\n");
+        exit(1);
+      }
+      bounce.reset((char*)ptr);
+    }
+    for (size_t pos = 0; pos < body; pos += DIRECT_BOUNCE) {
+      size_t n = min(DIRECT_BOUNCE, body - pos), ret;
+      if (write) {
+        memcpy(bounce.get(), buf + head + pos, n);
+        ret = plainWrite(dfd, bounce.get(), n, offset + head + pos);
+      } else {
+        ret = plainRead(dfd, bounce.get(), n, offset + head + pos);
+        memcpy(buf + head + pos, bounce.get(), ret);
+      }
+      done += ret;
+      if (ret < n)
+        return done;
+    }
+  }
+  done += (write ? plainWrite(fd, buf + head + body, nbyte - head - body, offset + head + body)
+                 : plainRead(fd, buf + head + body, nbyte - head - body, offset + head + body));
+
+  return done;
+}
+
+size_t readFromFile(int fd, void *buf, size_t nbyte, size_t offset)
+{
+  size_t done;
+  if (directFd(fd) != -1) {
+    done = directTransfer(false, fd, (char*)buf, nbyte, offset);
+  } else {
+    posix_fadvise(fd, offset, nbyte, POSIX_FADV_WILLNEED);
+    posix_fadvise(fd, offset, nbyte, POSIX_FADV_SEQUENTIAL);
+    done = plainRead(fd, (char*)buf, nbyte, offset);
+  }
+  stats.read(fd, done);
+  return done;
+}
+
+size_t writeToFile(int fd, const void *buf, size_t nbyte, size_t offset)
+{
+  size_t done;
+  if (directFd(fd) != -1)
+    done = directTransfer(true, fd, (char*)buf, nbyte, offset);
+  else
+    done = plainWrite(fd, (const char*)buf, nbyte, offset);
+  stats.wrote(fd, done);
+  return done;
+}
+
 void printKey(TUPLETYPE tuple)
 {
-  for (int j = 0; j < 10; j++)
-    printf("%x ", tuple.binary[j]);
+  for (size_t j = 0; j < KEY_SIZE; j++)
+    printf("%x ", keyOf(tuple)[j]);
   printf("\n");
 }
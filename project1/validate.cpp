@@ -0,0 +1,129 @@
+#include "external_sort.h"
+#include <chrono>
+#include <sys/mman.h>
+#include <sys/stat.h>
+using namespace std::chrono;
+
+// check a sort without a reference output: outfile is in key order, and holds the same
+// tuples as infile. both files are mmaped, every thread walks its own slice of them.
+// usage: ./validate [-t threads] [infile] outfile
+// permutation check compares an order independent checksum, the sum of tupleSum(tuple, 0)
+// over the file(also printed by data_gen), and tuple counts.
+#define VALIDATE_WINDOW (64000000UL)
+
+class MAPPED {
+  public:
+    const TUPLETYPE *tuples;
+    size_t count;
+    uint64_t sum;
+    size_t unsorted;    // first tuple smaller than the one before, count if none
+
+    MAPPED() : tuples(NULL), count(0), sum(0), unsorted(0) {};
+    bool map(const char *path);
+    void unmap() { if (count) munmap((void*)tuples, count * TUPLE_SIZE); }
+    void scan(bool order);
+};
+
+bool MAPPED::map(const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) != 0) {
+    printf("error: open %s file\n", path);
+    return false;
+  }
+  if (st.st_size % TUPLE_SIZE)
+    printf("%s: %lld bytes is not whole tuples, last %lld ignored\n", path,
+           (long long)st.st_size, (long long)(st.st_size % TUPLE_SIZE));
+  count  = st.st_size / TUPLE_SIZE;
+  tuples = NULL;
+  if (count) {
+    void *addr = mmap(NULL, count * TUPLE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+      printf("error: mmap %s file\n", path);
+      close(fd);
+      return false;
+    }
+    madvise(addr, count * TUPLE_SIZE, MADV_SEQUENTIAL);
+    tuples = (const TUPLETYPE*)addr;
+  }
+  close(fd);
+
+  return (st.st_size % TUPLE_SIZE) == 0;
+}
+
+// every thread sums its slice window by window, asking the kernel for the next window
+// ahead. order also compares each tuple with the one before, across slices too.
+void MAPPED::scan(bool order)
+{
+  const size_t window = max((size_t)1, VALIDATE_WINDOW / TUPLE_SIZE);
+  uint64_t total = 0;
+  size_t first_bad = count;
+  #pragma omp parallel num_threads(max_threads) reduction(+:total) reduction(min:first_bad)
+  {
+    const int threads = omp_get_num_threads(), id = omp_get_thread_num();
+    const size_t begin = count * id / threads, end = count * (id + 1) / threads;
+    for (size_t w = begin; w < end; w += window) {
+      const size_t w_end = min(end, w + window);
+      if (w_end < end)
+        madvise((void*)((uintptr_t)(tuples + w_end) & ~(uintptr_t)(getpagesize() - 1)),
+                min(window, end - w_end) * TUPLE_SIZE, MADV_WILLNEED);
+      for (size_t i = w; i < w_end; i++) {
+        total += tupleSum(tuples[i], 0);
+        if (order && i > 0 && i < first_bad && tuples[i] < tuples[i-1])
+          first_bad = i;
+      }
+    }
+  }
+  sum      = total;
+  unsorted = first_bad;
+}
+
+int main(int argc, char* argv[])
+{
+  int opt;
+  while ((opt = getopt(argc, argv, "t:")) != -1) {
+    if (opt == 't') {
+      max_threads = max(1, atoi(optarg));
+    } else {
+      optind = argc + 1;
+      break;
+    }
+  }
+  if (optind >= argc || argc - optind > 2) {
+    printf("usage: %s [-t threads] [infile] outfile\n", argv[0]);
+    return 1;
+  }
+
+  const bool permutation = (argc - optind == 2);
+  const char *in_path = argv[optind], *out_path = argv[argc - 1];
+  auto start = high_resolution_clock::now();
+  MAPPED in, out;
+  bool ok = out.map(out_path);
+  ok = (permutation ? in.map(in_path) : true) && ok;
+  if (out.count == 0 && !ok)
+    return 1;
+
+  out.scan(true);
+  if (out.unsorted < out.count) {
+    printf("%s: tuple %zu is out of order\n", out_path, out.unsorted);
+    ok = false;
+  }
+  printf("%s: %zu tuples %s, checksum %016llx\n", out_path, out.count,
+         (out.unsorted == out.count ? "sorted" : "NOT SORTED"), (unsigned long long)out.sum);
+  if (permutation) {
+    in.scan(false);
+    bool same = (in.count == out.count && in.sum == out.sum);
+    printf("%s: %zu tuples, checksum %016llx, %s\n", in_path, in.count, (unsigned long long)in.sum,
+           (same ? "same tuples" : "DIFFERENT TUPLES"));
+    ok = ok && same;
+    in.unmap();
+  }
+  out.unmap();
+
+  long long ms = duration_cast<milliseconds>(high_resolution_clock::now() - start).count();
+  printf("%s in %lldms, %.1f MB/s\n", (ok ? "OK" : "FAILED"), ms,
+         (in.count * permutation + out.count) * TUPLE_SIZE / 1000.0 / max(ms, 1LL));
+
+  return !ok;
+}